@@ -1,20 +1,55 @@
 // IDENTIFIER  = 292F24D17A4455C1B5133EDD8C7CEAA0C9570A98
 
 #include <iostream>
-#include <fstream>
-#include <sstream>
 #include <unordered_map>
-#include <queue>
-#include <vector>
 #include <unordered_set>
+#include <vector>
 #include <algorithm>
 #include <ctime>
+#include <cctype>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <charconv>
+#include <type_traits>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <csignal>
 #include <getopt.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 using namespace std;
 
 // ---OPTIONS---
 std::string registration_filename;
+std::string snapshot_filename;
+std::string restore_filename;
+std::string journal_filename;
+size_t journal_sync = 0;
+size_t settlement_shards = 1;
+std::string listen_path;
+uint16_t tcp_port = 0;
+bool live_query_mode = false;
+std::string stats_filename;
+bool pipeline_mode = false;
+std::string events_filename;
+bool binary_input = false;
 int transaction_counter = 0;
 bool verbose = false;
 bool query_mode = false;
@@ -25,6 +60,18 @@ void printHelp(const char* command) {
     std::cout << "  -h, --help           Show this help message\n";
     std::cout << "  -f, --file filename  Specify the registration file (required)\n";
     std::cout << "  -v, --verbose        Enable verbose mode\n";
+    std::cout << "  -s, --snapshot file  Save engine state to file when operations end (before $$$ drains the queue)\n";
+    std::cout << "  -r, --restore file   Start from a saved snapshot instead of the registration file\n";
+    std::cout << "  -j, --journal file   Replay this journal on startup, then append placements and settlements to it\n";
+    std::cout << "  --journal-sync N     fsync the journal after every N records (default 0: group writes, no fsync)\n";
+    std::cout << "  --listen path        Run as a server on this Unix domain socket instead of reading stdin\n";
+    std::cout << "  --tcp-port N         Also (or only) serve clients on localhost TCP port N\n";
+    std::cout << "  --live-queries       Answer l/r/h/s queries placed between operations, without waiting for $$$\n";
+    std::cout << "  --stats file         Write latency histograms and counters to file as JSON at exit\n";
+    std::cout << "  --events file        Write diagnostics to file as binary event records (instead of --verbose)\n";
+    std::cout << "  --binary             Read stdin as a binary command file from bench/command_convert (overrides --pipeline)\n";
+    std::cout << "  --pipeline           Parse commands on a separate thread, overlapping parsing with settlement\n";
+    std::cout << "  --shards N           Settle large batches of due transactions on N account shards (default 1: single-threaded, 0: one per core)\n";
 }
 
 void getOptions(int argc, char** argv) {
@@ -32,13 +79,25 @@ void getOptions(int argc, char** argv) {
         {"help", no_argument, nullptr, 'h'},
         {"file", required_argument, nullptr, 'f'},
         {"verbose", no_argument, nullptr, 'v'},
+        {"snapshot", required_argument, nullptr, 's'},
+        {"restore", required_argument, nullptr, 'r'},
+        {"journal", required_argument, nullptr, 'j'},
+        {"journal-sync", required_argument, nullptr, 'J'},
+        {"shards", required_argument, nullptr, 'S'},
+        {"listen", required_argument, nullptr, 'L'},
+        {"tcp-port", required_argument, nullptr, 'T'},
+        {"live-queries", no_argument, nullptr, 'Q'},
+        {"stats", required_argument, nullptr, 'X'},
+        {"pipeline", no_argument, nullptr, 'P'},
+        {"events", required_argument, nullptr, 'E'},
+        {"binary", no_argument, nullptr, 'B'},
         {nullptr, 0, nullptr, 0}
     };
 
     int opt;
     int option_index = 0;
 
-    while ((opt = getopt_long(argc, argv, "hvf:", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hvf:s:r:j:", long_options, &option_index)) != -1) {
         switch (opt) {
             case 'h':
                 printHelp(argv[0]);
@@ -49,16 +108,57 @@ void getOptions(int argc, char** argv) {
             case 'f':
                 registration_filename = optarg;
                 break;
+            case 's':
+                snapshot_filename = optarg;
+                break;
+            case 'r':
+                restore_filename = optarg;
+                break;
+            case 'j':
+                journal_filename = optarg;
+                break;
+            case 'J':
+                journal_sync = static_cast<size_t>(stoul(optarg));
+                break;
+            case 'S':
+                settlement_shards = static_cast<size_t>(stoul(optarg));
+                break;
+            case 'L':
+                listen_path = optarg;
+                break;
+            case 'T':
+                tcp_port = static_cast<uint16_t>(stoul(optarg));
+                break;
+            case 'Q':
+                live_query_mode = true;
+                break;
+            case 'X':
+                stats_filename = optarg;
+                break;
+            case 'P':
+                pipeline_mode = true;
+                break;
+            case 'E':
+                events_filename = optarg;
+                break;
+            case 'B':
+                binary_input = true;
+                break;
             default:
                 std::cerr << "Invalid option. Use --help to see usage.\n";
                 exit(1);
         }
     }
 
-    if (registration_filename.empty()) {
+    if (registration_filename.empty() && restore_filename.empty()) {
         std::cerr << "Error: registrations filename not specified.\n";
         exit(1);
     }
+
+    if (verbose && !events_filename.empty()) {
+        std::cerr << "Error: --events and --verbose cannot be combined.\n";
+        exit(1);
+    }
 }
 
 // ---OPTIONS---
@@ -66,658 +166,3613 @@ void getOptions(int argc, char** argv) {
 
 // ---DATA_STRUCTURES---
 
+// Timestamps arrive as "yy:mm:dd:hh:mm:ss" and are packed once into the
+// integer yymmddhhmmss, which orders the same way and prints as the output form
+struct Timestamp {
+    uint64_t value = 0;
+
+    Timestamp() = default;
+    explicit Timestamp(uint64_t value) : value(value) {};
+
+    // parse "yy:mm:dd:hh:mm:ss" (colons are skipped, so "" parses as 0)
+    static Timestamp parse(string_view text) {
+        uint64_t packed = 0;
+        for (char c : text) {
+            if (c != ':') packed = packed * 10 + static_cast<uint64_t>(c - '0');
+        }
+        return Timestamp(packed);
+    }
+
+    bool operator==(const Timestamp& other) const { return value == other.value; }
+    bool operator!=(const Timestamp& other) const { return value != other.value; }
+    bool operator<(const Timestamp& other) const { return value < other.value; }
+    bool operator>(const Timestamp& other) const { return value > other.value; }
+    bool operator<=(const Timestamp& other) const { return value <= other.value; }
+    bool operator>=(const Timestamp& other) const { return value >= other.value; }
+};
+
+// Dense account id, assigned when the registration file is loaded
+using AccountId = uint32_t;
+const AccountId NO_ACCOUNT = UINT32_MAX;
+
+// A plain fixed-width record (widest fields first, so 40 bytes with no
+// interior padding): it is copied by value into the scheduler's recycled
+// pool, settlement batches and the history, none of which allocate per
+// transaction once warmed up
 struct Transaction {
+    Timestamp place_timestamp;
+    Timestamp exec_timestamp;
     int id = 0;
-    string place_timestamp;
-    string exec_timestamp;
-    string sender;
-    string recipient;
+    AccountId sender = NO_ACCOUNT;
+    AccountId recipient = NO_ACCOUNT;
     unsigned int amount = 0;
-    char fee_type = 'o'; // 'o' or 's'
     unsigned int fee = 0;
+    char fee_type = 'o'; // 'o' or 's'
     bool executed = false;
 
     Transaction() = default;
     // custom ctor for placeTransaction()
-Transaction(string place_timestamp, string exec_timestamp, string sender, 
-            string recipient, unsigned int amount, char fee_type) :
+Transaction(Timestamp place_timestamp, Timestamp exec_timestamp, AccountId sender, 
+            AccountId recipient, unsigned int amount, char fee_type) :
     place_timestamp(place_timestamp), exec_timestamp(exec_timestamp),
     sender(sender), recipient(recipient), amount(amount), fee_type(fee_type) {
         id = transaction_counter++;
     };
 };
+static_assert(is_trivially_copyable_v<Transaction> && sizeof(Transaction) == 40,
+              "Transaction should stay a compact plain record");
+
+// Session IPs that are not canonical IPv4/IPv6 text, numbered in order seen
+struct IpNameTable {
+    unordered_map<string_view, uint32_t> numbers; // keys view into names
+    deque<string> names; // deque so the viewed strings never move
+
+    uint32_t intern(string_view name) {
+        auto it = numbers.find(name);
+        if (it != numbers.end()) return it->second;
+        uint32_t number = static_cast<uint32_t>(names.size());
+        names.emplace_back(name);
+        numbers.emplace(names.back(), number);
+        return number;
+    }
 
-// Users
-struct User {
-    string pin;
-    uint32_t balance;
-    string reg_timestamp;
-    unordered_set<string> active_ips;
-    vector<Transaction> incoming;
-    vector<Transaction> outgoing;
-    bool logged_in = false;
-
-    User() = default;
-    // custom ctor for loading registrations.txt
-    User(string pin, uint32_t balance, string reg_timestamp) : pin(pin), balance(balance), reg_timestamp(reg_timestamp) {};
+    // UINT32_MAX if the name was never interned
+    uint32_t find(string_view name) const {
+        auto it = numbers.find(name);
+        return it == numbers.end() ? UINT32_MAX : it->second;
+    }
 };
-unordered_map<string, User> users;
+IpNameTable ip_names;
+
+// A session IP as a fixed-width 128-bit value, parsed once per command.
+// Canonical IPv6 text (RFC 5952) is stored as the address itself and
+// canonical dotted IPv4 as an IPv4-mapped address. Any other text, including
+// other spellings of an address, is interned and stored as ::fffe:<number>,
+// with IPv6 addresses in the ::ffff:0:0/95 range going the same way. Two IPs
+// are therefore equal exactly when their text is, as with the old string sets.
+struct IpAddress {
+    uint64_t high = 0;
+    uint64_t low = 0;
+
+    static const uint64_t IPV4_TAG = 0xffff;
+    static const uint64_t NAME_TAG = 0xfffe;
+
+    bool operator==(const IpAddress& other) const { return high == other.high && low == other.low; }
+    bool operator!=(const IpAddress& other) const { return !(*this == other); }
+
+    // for login: unseen non-canonical text is interned
+    static IpAddress parse(string_view text) {
+        IpAddress ip;
+        if (parseCanonical(text, ip)) return ip;
+        return named(ip_names.intern(text));
+    }
 
-// ---DATA_STRUCTURES---
+    // for session checks: unseen non-canonical text matches no session
+    static IpAddress lookup(string_view text) {
+        IpAddress ip;
+        if (parseCanonical(text, ip)) return ip;
+        return named(ip_names.find(text));
+    }
 
+    // a lookup of text that was never interned
+    bool unknown() const { return high == 0 && low == ((NAME_TAG << 32) | UINT32_MAX); }
 
-// ---HELPERS---
+    string text() const {
+        if (high == 0 && (low >> 32) == NAME_TAG) return ip_names.names[low & UINT32_MAX];
+        string out;
+        if (high == 0 && (low >> 32) == IPV4_TAG) {
+            for (int shift = 24; shift >= 0; shift -= 8) {
+                out += to_string((low >> shift) & 0xff);
+                if (shift) out += '.';
+            }
+            return out;
+        }
+        char buffer[IPV6_TEXT_SIZE];
+        return string(buffer, formatIpv6(buffer));
+    }
+
+private:
+    static const size_t IPV6_TEXT_SIZE = 40;
 
-string removeColonsAndLeadingZeros(const string& timestamp) {
-    string raw;
-    for (char c : timestamp) {
-        if (c != ':') raw += c;
+    // canonical RFC 5952 text of the address into out; returns its length
+    size_t formatIpv6(char* out) const {
+        size_t length = 0;
+        uint16_t groups[8];
+        for (int i = 0; i < 8; ++i) {
+            uint64_t half = i < 4 ? high : low;
+            groups[i] = static_cast<uint16_t>(half >> (16 * (3 - i % 4)));
+        }
+        // the first longest run of two or more zero groups becomes "::"
+        int run_start = -1, run_length = 1;
+        for (int i = 0; i < 8;) {
+            int j = i;
+            while (j < 8 && groups[j] == 0) ++j;
+            if (j - i > run_length) {
+                run_start = i;
+                run_length = j - i;
+            }
+            i = j == i ? i + 1 : j;
+        }
+        const char* digits = "0123456789abcdef";
+        for (int i = 0; i < 8; ++i) {
+            if (i == run_start) {
+                out[length++] = ':';
+                out[length++] = ':';
+                i += run_length - 1;
+                continue;
+            }
+            if (i > 0 && i != run_start + run_length) out[length++] = ':';
+            bool leading = true;
+            for (int shift = 12; shift >= 0; shift -= 4) {
+                int digit = (groups[i] >> shift) & 0xf;
+                if (leading && digit == 0 && shift > 0) continue;
+                leading = false;
+                out[length++] = digits[digit];
+            }
+        }
+        return length;
     }
 
-    // Remove leading zeros
-    size_t first_nonzero = raw.find_first_not_of('0');
-    if (first_nonzero != string::npos) {
-        return raw.substr(first_nonzero);
-    } else {
-        return "0";  // all zeros
+    static IpAddress named(uint32_t number) {
+        IpAddress ip;
+        ip.low = (NAME_TAG << 32) | number;
+        return ip;
     }
-}
 
-class CompareExecDate {
-public:
-    bool operator()(const Transaction& a, const Transaction& b) {
-        if (a.exec_timestamp != b.exec_timestamp) {
-            return stoull(removeColonsAndLeadingZeros(a.exec_timestamp)) > stoull(removeColonsAndLeadingZeros(b.exec_timestamp));
+    static bool parseCanonical(string_view text, IpAddress& ip) {
+        return parseIpv4(text, ip) || parseIpv6(text, ip);
+    }
+
+    // four decimal octets without leading zeros
+    static bool parseIpv4(string_view text, IpAddress& ip) {
+        uint64_t address = 0;
+        size_t pos = 0;
+        for (int octet = 0; octet < 4; ++octet) {
+            if (octet > 0) {
+                if (pos >= text.size() || text[pos] != '.') return false;
+                ++pos;
+            }
+            size_t start = pos;
+            unsigned value = 0;
+            while (pos < text.size() && pos - start < 3 && text[pos] >= '0' && text[pos] <= '9') {
+                value = value * 10 + static_cast<unsigned>(text[pos++] - '0');
+            }
+            if (pos == start || value > 255 || (text[start] == '0' && pos - start > 1)) return false;
+            address = (address << 8) | value;
         }
-        return a.id > b.id;
+        if (pos != text.size()) return false;
+        ip.high = 0;
+        ip.low = (IPV4_TAG << 32) | address;
+        return true;
     }
-};
 
-// Format time interval for revenue reporting
+    // hex groups with at most one "::"; accepted only if the text is exactly
+    // how text() would print the address
+    static bool parseIpv6(string_view text, IpAddress& ip) {
+        if (text.size() < 2 || text.size() > 39 || text.find(':') == string_view::npos) return false;
+        uint16_t groups[8] = {};
+        int count = 0, gap = -1;
+        size_t pos = 0;
+        if (text.substr(0, 2) == "::") {
+            gap = 0;
+            pos = 2;
+        }
+        while (pos < text.size()) {
+            size_t start = pos;
+            unsigned value = 0;
+            while (pos < text.size() && pos - start < 4 && isxdigit(static_cast<unsigned char>(text[pos]))) {
+                char c = text[pos++];
+                value = value * 16 + static_cast<unsigned>(c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+            }
+            if (pos == start || count == 8) return false;
+            groups[count++] = static_cast<uint16_t>(value);
+            if (pos == text.size()) break;
+            if (text[pos] != ':') return false;
+            ++pos;
+            if (pos < text.size() && text[pos] == ':') {
+                if (gap != -1) return false;
+                gap = count;
+                ++pos;
+            } else if (pos == text.size()) {
+                return false;
+            }
+        }
+        if (gap == -1 ? count != 8 : count > 7) return false;
+        if (gap != -1) {
+            int missing = 8 - count;
+            for (int i = count - 1; i >= gap; --i) groups[i + missing] = groups[i];
+            for (int i = gap; i < gap + missing; ++i) groups[i] = 0;
+        }
 
+        IpAddress parsed;
+        for (int i = 0; i < 8; ++i) {
+            uint64_t& half = i < 4 ? parsed.high : parsed.low;
+            half = (half << 16) | groups[i];
+        }
+        uint64_t tag = parsed.low >> 32;
+        if (parsed.high == 0 && (tag == IPV4_TAG || tag == NAME_TAG)) return false;
+        // only the canonical spelling is stored as the address itself
+        char canonical[IPV6_TEXT_SIZE];
+        if (string_view(canonical, parsed.formatIpv6(canonical)) != text) return false;
+        ip = parsed;
+        return true;
+    }
+};
 
+// Each account's session IPs: the first INLINE_SESSIONS live in the
+// account's own slot, and the rare accounts with more sessions keep the
+// rest in a shared side table
+struct SessionTable {
+    static constexpr uint32_t INLINE_SESSIONS = 2;
 
+    struct Sessions {
+        IpAddress ips[INLINE_SESSIONS];
+        uint32_t count = 0;
+    };
 
+    vector<Sessions> accounts;
+    unordered_map<AccountId, vector<IpAddress>> overflow;
 
-string formatTimeInterval(uint64_t start, uint64_t end) {
-    string difference = to_string(end - start);
+    void reserve(size_t count) { accounts.reserve(count); }
+    void addAccount() { accounts.emplace_back(); }
 
-    while(difference.size() != 12) {
-        difference = "0" + difference;
+    bool contains(AccountId id, IpAddress ip) const {
+        const Sessions& sessions = accounts[id];
+        uint32_t inline_count = min(sessions.count, INLINE_SESSIONS);
+        for (uint32_t i = 0; i < inline_count; ++i) {
+            if (sessions.ips[i] == ip) return true;
+        }
+        if (sessions.count <= INLINE_SESSIONS) return false;
+        const vector<IpAddress>& extra = overflow.at(id);
+        return find(extra.begin(), extra.end(), ip) != extra.end();
     }
 
-    vector<string> parts;
-    vector<string> words = {" year", " month", " day", " hour", " minute", " second" };
-    // Extract two digits at a time from the end
-    size_t j = 12;
-    for (size_t i = 6; i > 0; i--) {
-        if (difference.substr(j-2, 1) != "0") {
-            parts.push_back((difference.substr(j - 2, 2)) + words[i-1]);
-        } else { 
-            parts.push_back((difference.substr(j - 1, 1)) + words[i-1]);
-        }
-        j -= 2;
+    // adding an IP that already has a session changes nothing
+    void insert(AccountId id, IpAddress ip) {
+        if (contains(id, ip)) return;
+        Sessions& sessions = accounts[id];
+        if (sessions.count < INLINE_SESSIONS) sessions.ips[sessions.count] = ip;
+        else overflow[id].push_back(ip);
+        ++sessions.count;
     }
-    string result;
-    for (size_t i = parts.size(); i-- > 0;) {
-        if(parts[i].substr(0,2) != "0 ") {
-            if(parts[i].substr(0,2) == "1 ") {
-                result += parts[i] + " ";
+
+    // false if there was no session from this IP
+    bool erase(AccountId id, IpAddress ip) {
+        Sessions& sessions = accounts[id];
+        uint32_t inline_count = min(sessions.count, INLINE_SESSIONS);
+        for (uint32_t i = 0; i < inline_count; ++i) {
+            if (sessions.ips[i] != ip) continue;
+            // refill the slot from the overflow, or from the last inline slot
+            if (sessions.count > INLINE_SESSIONS) {
+                sessions.ips[i] = takeLastOverflow(id);
             } else {
-                result += (parts[i] + "s ");
+                sessions.ips[i] = sessions.ips[inline_count - 1];
             }
+            --sessions.count;
+            return true;
         }
-    }
-    // Remove trailing space if present
-    if (!result.empty() && result.back() == ' ') {
-        result.pop_back();
+        if (sessions.count <= INLINE_SESSIONS) return false;
+        vector<IpAddress>& extra = overflow.at(id);
+        auto it = find(extra.begin(), extra.end(), ip);
+        if (it == extra.end()) return false;
+        *it = extra.back();
+        extra.pop_back();
+        if (extra.empty()) overflow.erase(id);
+        --sessions.count;
+        return true;
     }
 
-    return result;
-}
+    bool empty(AccountId id) const { return accounts[id].count == 0; }
 
+    template <typename Visit>
+    void forEach(AccountId id, Visit visit) const {
+        const Sessions& sessions = accounts[id];
+        for (uint32_t i = 0; i < min(sessions.count, INLINE_SESSIONS); ++i) visit(sessions.ips[i]);
+        if (sessions.count > INLINE_SESSIONS) {
+            for (const IpAddress& ip : overflow.at(id)) visit(ip);
+        }
+    }
+
+private:
+    IpAddress takeLastOverflow(AccountId id) {
+        auto it = overflow.find(id);
+        IpAddress ip = it->second.back();
+        it->second.pop_back();
+        if (it->second.empty()) overflow.erase(it);
+        return ip;
+    }
+};
 
+// One side (incoming or outgoing) of an account's executed transactions:
+// the exact count plus a ring of the latest few, as indices into
+// transaction_history. customerHistory never shows more than the ring
+// holds, so per-account memory stays fixed however long the run is.
+struct RecentHistory {
+    static const uint32_t KEPT = 10;
 
+    uint32_t latest[KEPT];
+    uint32_t total = 0;
 
-// Calculate transaction fee
-unsigned int calculateTransactionFee(const Transaction& t) {
-    unsigned int fee = t.amount / 100; // 1% of amount
-    fee = max(10u, min(450u, fee));   // Apply min/max
-    
-    // Check if sender is a longstanding customer (>5 years)
-    uint64_t sender_reg = stoull(removeColonsAndLeadingZeros(users[t.sender].reg_timestamp)); 
-    uint64_t exec_time = stoull(removeColonsAndLeadingZeros(t.exec_timestamp));
-    if (exec_time - sender_reg > 50000000000) {
-        fee = (fee * 3) / 4; // 25% discount
+    void add(uint32_t history_index) {
+        latest[total % KEPT] = history_index;
+        ++total;
     }
-    
-    return fee;
-}
 
-//---HELPERS---
+    size_t size() const { return total; }
 
-// ---FORWARD_DECLARATIONS---
+    // the kept indices, oldest first
+    template <typename Visit>
+    void forEachLatest(Visit visit) const {
+        uint32_t first = total > KEPT ? total - KEPT : 0;
+        for (uint32_t i = first; i < total; ++i) visit(latest[i % KEPT]);
+    }
+};
 
-struct Transaction;
-struct User;
-// Global variables;
-string current_timestamp;
-string last_place_timestamp;
-priority_queue<Transaction, vector<Transaction>, CompareExecDate> transaction_queue;
-vector<Transaction> transaction_history;
+// Users
+// User ids are interned to dense AccountIds once, and each piece of account
+// state lives in its own array indexed by that id
+struct AccountTable {
+    unordered_map<string_view, AccountId> ids; // keys view into user_ids
+    deque<string> user_ids; // deque so the viewed strings never move
+    vector<string> pins;
+    vector<uint32_t> balances;
+    vector<Timestamp> reg_timestamps;
+    vector<Timestamp> loyalty_timestamps; // first exec time with the long-standing customer discount
+    SessionTable sessions;
+    vector<RecentHistory> incoming;
+    vector<RecentHistory> outgoing;
+    vector<char> logged_in;
+
+    // Senders get the discount once exec - reg > 5 years in packed form
+    // (exec time never precedes registration for a placed transaction)
+    static Timestamp loyaltyStart(Timestamp reg_timestamp) {
+        return Timestamp(reg_timestamp.value + 50000000000 + 1);
+    }
 
-// ---FORWARD_DECLARATIONS---
+    AccountId find(string_view user_id) const {
+        auto it = ids.find(user_id);
+        return it == ids.end() ? NO_ACCOUNT : it->second;
+    }
 
+    void reserve(size_t count) {
+        ids.reserve(count);
+        pins.reserve(count);
+        balances.reserve(count);
+        reg_timestamps.reserve(count);
+        loyalty_timestamps.reserve(count);
+        sessions.reserve(count);
+        incoming.reserve(count);
+        outgoing.reserve(count);
+        logged_in.reserve(count);
+    }
 
-//---BIGGER_FUNCTIONS---
+    // for loading registrations.txt; a repeated user id replaces the account
+    AccountId add(string_view user_id, string_view pin, uint32_t balance, Timestamp reg_timestamp) {
+        AccountId id = find(user_id);
+        if (id == NO_ACCOUNT) {
+            id = static_cast<AccountId>(user_ids.size());
+            user_ids.emplace_back(user_id);
+            ids.emplace(user_ids.back(), id);
+            pins.emplace_back(pin);
+            balances.push_back(balance);
+            reg_timestamps.push_back(reg_timestamp);
+            loyalty_timestamps.push_back(loyaltyStart(reg_timestamp));
+            sessions.addAccount();
+            incoming.emplace_back();
+            outgoing.emplace_back();
+            logged_in.push_back(false);
+        } else {
+            pins[id] = pin;
+            balances[id] = balance;
+            reg_timestamps[id] = reg_timestamp;
+            loyalty_timestamps[id] = loyaltyStart(reg_timestamp);
+        }
+        return id;
+    }
+};
+AccountTable accounts;
+
+// Fees indexed by place time, for revenue queries.
+// Ids are handed out in placement order and place timestamps never decrease,
+// so place_times (indexed by id) is sorted and a Fenwick tree over ids gives
+// the fee total for any place-time interval. Fees land as transactions
+// execute, which happens out of placement order.
+struct FeeIndex {
+    vector<Timestamp> place_times;
+    vector<uint64_t> tree; // 1-based Fenwick tree over transaction ids
+
+    // register a newly placed transaction (its fee is 0 until executed)
+    void addPlacement(Timestamp place_time) {
+        place_times.push_back(place_time);
+        size_t i = place_times.size();
+        size_t low = i & (~i + 1);
+        tree.push_back(prefixSum(i - 1) - prefixSum(i - low));
+    }
 
-// LOAD REGISTRTIONS
-void loadRegistrationFile(const string& filename) {
-    ifstream file(filename);
-    if (!file) {
-        cerr << "Error: Could not open registration file " << filename << "\n";
-        exit(1);
+    void addFee(int id, uint64_t fee) {
+        for (size_t i = static_cast<size_t>(id) + 1; i <= tree.size(); i += i & (~i + 1)) {
+            tree[i - 1] += fee;
+        }
     }
-    
-    string line;
-    while (getline(file, line)) {
-        istringstream iss(line);
-        string reg_timestamp, user_id, pin, balance_str;
-        
-        getline(iss, reg_timestamp, '|');
-        getline(iss, user_id, '|');
-        getline(iss, pin, '|');
-        getline(iss, balance_str);
-        
-        uint32_t balance = static_cast<uint32_t>(std::stoul(balance_str));
-        users[user_id] = User(pin, balance, reg_timestamp);
-        
-        // Set initial current timestamp to first registration if not set
-        if (current_timestamp.empty()) {
-            current_timestamp = reg_timestamp;
+
+    // sum of fees for ids [0, count)
+    uint64_t prefixSum(size_t count) const {
+        uint64_t sum = 0;
+        for (size_t i = count; i > 0; i -= i & (~i + 1)) {
+            sum += tree[i - 1];
         }
+        return sum;
     }
-}
-// LOGIN
-void handleLogin(const string& user_id, const string& pin, const string& ip) {
-    auto it = users.find(user_id);
-    if (it == users.end()) {
-        if (verbose) cout << "Login failed for " << user_id << ".\n";
-        return;
+
+    // sum of fees for transactions placed in [x, y)
+    uint64_t feesPlacedBetween(Timestamp x, Timestamp y) const {
+        size_t first = static_cast<size_t>(lower_bound(place_times.begin(), place_times.end(), x) - place_times.begin());
+        size_t last = static_cast<size_t>(lower_bound(place_times.begin(), place_times.end(), y) - place_times.begin());
+        return prefixSum(last) - prefixSum(first);
     }
-    
-    User& user = it->second;
-    if (user.pin != pin) {
-        if (verbose) cout << "Login failed for " << user_id << ".\n";
-        return;
+};
+
+// Per-day totals of executed transactions, keyed by exec day (yymmdd).
+// The history is appended in exec time order, so each day is one run of it
+// and days arrive in increasing order; the rollup for the latest day is
+// extended in place as transactions execute.
+struct DayRollups {
+    struct Day {
+        uint64_t day = 0;
+        uint32_t first = 0; // index of the day's first row in transaction_history
+        uint32_t count = 0;
+        uint64_t fees = 0;
+    };
+
+    vector<Day> days;
+
+    void addExecuted(Timestamp exec_timestamp, uint32_t history_index, uint64_t fee) {
+        uint64_t day = exec_timestamp.value / 1000000;
+        if (days.empty() || days.back().day != day) {
+            Day rollup;
+            rollup.day = day;
+            rollup.first = history_index;
+            days.push_back(rollup);
+        }
+        ++days.back().count;
+        days.back().fees += fee;
     }
-    
-    user.active_ips.insert(ip);
-    user.logged_in = true;
-    if (verbose) cout << "User " << user_id << " logged in.\n";
-}
-// LOGOUT
-void handleLogout(const string& user_id, const string& ip) {
-    auto it = users.find(user_id);
-    if (it == users.end()) {
-        if (verbose) cout << "Logout failed for " << user_id << ".\n";
-        return;
+
+    // nullptr if nothing executed that day
+    const Day* find(uint64_t day) const {
+        auto it = lower_bound(days.begin(), days.end(), day,
+                              [](const Day& rollup, uint64_t value) { return rollup.day < value; });
+        return (it == days.end() || it->day != day) ? nullptr : &*it;
     }
-    
-    User& user = it->second;
-    if (user.active_ips.count(ip) == 0) {
-        if (verbose) cout << "Logout failed for " << user_id << ".\n";
-        return;
+};
+
+// Pending transactions, released in (exec time, id) order.
+// A hierarchical timing wheel keyed on the packed exec timestamp: level L
+// has 64 slots for bits [6L, 6L + 6), and a transaction sits at the level of
+// the highest 6-bit group where its exec time differs from the wheel's
+// current time. Level 0 slots therefore hold a single exec time each. Slots
+// are FIFO lists of handles into a recycled pool, and transactions are
+// scheduled in id order, so ties come out by id. When level 0 runs dry the
+// next occupied slot of the lowest non-empty level is cascaded down, and
+// per-level occupancy bitmaps let the wheel skip the gaps in the packed
+// timestamps. Scheduling is O(1) and each transaction cascades at most
+// once per level.
+class TransactionScheduler {
+public:
+    TransactionScheduler() {
+        for (auto& level : slots) {
+            for (Slot& slot : level) slot = Slot();
+        }
     }
-    
-    user.active_ips.erase(ip);
-    if(user.active_ips.empty()) user.logged_in = false;
-    if (verbose) cout << "User " << user_id << " logged out.\n";
-}
-// BALANCE
-void handleBalance(const string& user_id, const string& ip) {
-    auto it = users.find(user_id);
-    if (it == users.end()) {
-        if (verbose) cout << "User " << user_id << " does not exist.\n";
-        return;
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+
+    // exec_timestamp must not be earlier than the last time drained up to
+    void schedule(const Transaction& t) {
+        uint32_t handle;
+        if (free_handles.empty()) {
+            handle = static_cast<uint32_t>(pool.size());
+            pool.push_back(t);
+            next.push_back(NO_HANDLE);
+        } else {
+            handle = free_handles.back();
+            free_handles.pop_back();
+            pool[handle] = t;
+        }
+        link(handle);
+        ++count;
     }
 
-    
-    User& user = it->second;
-    if (verbose && user.logged_in == false) {
-        cout << "User " << user_id << " is not logged in.\n";
-        return;
+    // Take the next transaction with exec time at or before until
+    bool popDue(Timestamp until, Transaction& out) {
+        while (count > 0) {
+            uint64_t bits = occupied[0] & (~0ull << (now & SLOT_MASK));
+            if (bits) {
+                uint32_t slot = static_cast<uint32_t>(__builtin_ctzll(bits));
+                uint64_t due = (now & ~SLOT_MASK) | slot;
+                if (due > until.value) return false;
+                now = due;
+                
+                Slot& list = slots[0][slot];
+                uint32_t handle = list.head;
+                list.head = next[handle];
+                if (list.head == NO_HANDLE) {
+                    list.tail = NO_HANDLE;
+                    occupied[0] &= ~(1ull << slot);
+                }
+                out = pool[handle];
+                free_handles.push_back(handle);
+                --count;
+                return true;
+            }
+            
+            // Level 0 is empty: move to the start of the next occupied slot
+            // of the lowest occupied level and spread it over lower levels
+            size_t level = 1;
+            while (level < LEVELS && occupied[level] == 0) ++level;
+            if (level == LEVELS) return false;
+            uint32_t slot = static_cast<uint32_t>(__builtin_ctzll(occupied[level]));
+            size_t shift = level * SLOT_BITS;
+            uint64_t above = (shift + SLOT_BITS < 64) ? (now >> (shift + SLOT_BITS)) << (shift + SLOT_BITS) : 0;
+            uint64_t start = above | (static_cast<uint64_t>(slot) << shift);
+            if (start > until.value) return false;
+            now = start;
+            
+            Slot list = slots[level][slot];
+            slots[level][slot] = Slot();
+            occupied[level] &= ~(1ull << slot);
+            for (uint32_t handle = list.head; handle != NO_HANDLE;) {
+                uint32_t following = next[handle];
+                link(handle);
+                handle = following;
+            }
+        }
+        return false;
+    }
+
+    // every pending transaction, in no particular order
+    template <typename Visit>
+    void forEach(Visit visit) const {
+        for (const auto& level : slots) {
+            for (const Slot& slot : level) {
+                for (uint32_t handle = slot.head; handle != NO_HANDLE; handle = next[handle]) {
+                    visit(pool[handle]);
+                }
+            }
+        }
     }
 
+private:
+    static const size_t SLOT_BITS = 6;
+    static const size_t SLOTS = 1 << SLOT_BITS;
+    static const uint64_t SLOT_MASK = SLOTS - 1;
+    static const size_t LEVELS = (64 + SLOT_BITS - 1) / SLOT_BITS;
+    static constexpr uint32_t NO_HANDLE = UINT32_MAX;
 
-    if (verbose && user.active_ips.count(ip) == 0) {
-        cout << "Fraudulent balance check detected, aborting request.\n";
-        return;
+    struct Slot {
+        uint32_t head = NO_HANDLE;
+        uint32_t tail = NO_HANDLE;
+    };
+
+    // append a handle to the slot its exec time belongs in relative to now
+    void link(uint32_t handle) {
+        uint64_t exec = pool[handle].exec_timestamp.value;
+        uint64_t differs = exec ^ now;
+        size_t level = differs ? (63 - static_cast<size_t>(__builtin_clzll(differs))) / SLOT_BITS : 0;
+        uint32_t slot = static_cast<uint32_t>((exec >> (level * SLOT_BITS)) & SLOT_MASK);
+        
+        Slot& list = slots[level][slot];
+        next[handle] = NO_HANDLE;
+        if (list.tail == NO_HANDLE) {
+            list.head = handle;
+            occupied[level] |= 1ull << slot;
+        } else {
+            next[list.tail] = handle;
+        }
+        list.tail = handle;
     }
+
+    uint64_t now = 0;
+    size_t count = 0;
+    uint64_t occupied[LEVELS] = {};
+    Slot slots[LEVELS][SLOTS];
+    vector<Transaction> pool;
+    vector<uint32_t> next;
+    vector<uint32_t> free_handles;
+};
+
+// ---DATA_STRUCTURES---
+
+
+// ---HELPERS---
+
+// Calculate transaction fee
+unsigned int transactionFee(unsigned int amount, uint64_t exec_time, uint64_t loyalty_time) {
+    unsigned int fee = amount / 100; // 1% of amount
+    fee = max(10u, min(450u, fee));   // Apply min/max
     
-    cout << "As of " << removeColonsAndLeadingZeros(current_timestamp) << ", " << user_id 
-         << " has a balance of $" << user.balance << ".\n";
+    // 25% discount for longstanding customers (>5 years)
+    return exec_time >= loyalty_time ? (fee * 3) / 4 : fee;
 }
 
-// ---BIGGER_FUNCTIONS---
+// parse the leading digits of a token (like stoul, without the copy)
+uint32_t parseUnsigned(string_view text) {
+    uint32_t value = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') break;
+        value = value * 10 + static_cast<uint32_t>(c - '0');
+    }
+    return value;
+}
 
-// ---TRANSACTION_FUNCTIONS---
+//---HELPERS---
 
-// POCESS TRANSACTIONS
-void processTransactions() {
-    while (!transaction_queue.empty()) {
-        const Transaction &t = transaction_queue.top();
-        uint64_t exec_sec = stoull(removeColonsAndLeadingZeros(t.exec_timestamp));
-        uint64_t curr_sec = stoull(removeColonsAndLeadingZeros(current_timestamp));
-        
-        // Stop if execution time is in the future (unless in query mode)
-        if (!query_mode && exec_sec > curr_sec) break;
+// ---INPUT---
 
-        // Copy the transaction before popping
-        Transaction t_processed = t;
-        transaction_queue.pop();
+// Read-only mapping of a whole regular file
+class MappedFile {
+public:
+    MappedFile() = default;
 
-        // Check if users still exist
-        if (users.count(t_processed.sender) == 0 || users.count(t_processed.recipient) == 0) {
-            if (verbose) cout << "Insufficient funds to process transaction " << t_processed.id << ".\n";
-            continue;
-        }
+    ~MappedFile() {
+        if (mapped) munmap(const_cast<char*>(mapped), length);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // false if fd is not a non-empty regular file or cannot be mapped
+    bool map(int fd) {
+        struct stat info;
+        if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size <= 0) return false;
+        size_t size = static_cast<size_t>(info.st_size);
+        void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) return false;
+        madvise(map, size, MADV_SEQUENTIAL);
+        mapped = static_cast<const char*>(map);
+        length = size;
+        return true;
+    }
 
-        User &sender = users[t_processed.sender];
-        User &recipient = users[t_processed.recipient];
+    const char* data() const { return mapped; }
+    size_t size() const { return length; }
 
-        // Calculate fee and required amounts
-        t_processed.fee = calculateTransactionFee(t_processed);
-        uint32_t sender_total = t_processed.amount + 
-                              (t_processed.fee_type == 'o' ? t_processed.fee : (t_processed.fee + 1) / 2);
-        uint32_t recipient_total = (t_processed.fee_type == 's' ? t_processed.fee / 2 : 0);
+private:
+    const char* mapped = nullptr;
+    size_t length = 0;
+};
 
-        // Check sufficient funds
-        if (sender.balance < sender_total || recipient.balance < recipient_total) {
-            if (verbose) cout << "Insufficient funds to process transaction " << t_processed.id << ".\n";
-            continue; // Discard transaction
+// Reads the command stream a line at a time without copying it.
+// A regular file on stdin is memory-mapped whole; pipes and terminals are
+// read in large chunks. Returned lines view into the map or the chunk buffer
+// and stay valid until the next call.
+class CommandReader {
+public:
+    explicit CommandReader(int fd) : fd(fd) {
+        if (file.map(fd)) {
+            end = file.size();
+            eof = true;
+            return;
         }
+        buffer.resize(CHUNK_SIZE);
+    }
 
-        // Execute transaction
-        sender.balance -= sender_total;
-        recipient.balance += t_processed.amount;
-        if (t_processed.fee_type == 's') {
-            recipient.balance -= recipient_total;
+    // next line without its '\n'; false once the input is exhausted
+    bool nextLine(string_view& line) {
+        while (true) {
+            const char* data = file.data() ? file.data() : buffer.data();
+            const void* newline = memchr(data + pos, '\n', end - pos);
+            if (newline) {
+                size_t stop = static_cast<size_t>(static_cast<const char*>(newline) - data);
+                line = string_view(data + pos, stop - pos);
+                pos = stop + 1;
+                return true;
+            }
+            if (eof) {
+                if (pos == end) return false;
+                line = string_view(data + pos, end - pos);
+                pos = end;
+                return true;
+            }
+            refill();
         }
+    }
 
-        // Record transaction
-        t_processed.executed = true;
-        transaction_history.push_back(t_processed);
-        sender.outgoing.push_back(t_processed);
-        recipient.incoming.push_back(t_processed);
+    // While set, a read that would block also ends the input as soon as
+    // wake_fd becomes readable (-1 turns this off again)
+    void setWakeFd(int new_wake_fd) { wake_fd = new_wake_fd; }
 
-        if (verbose) {
-            cout << "Transaction " << t_processed.id << " executed at "
-                 << removeColonsAndLeadingZeros(t_processed.exec_timestamp) << ": $"
-                 << t_processed.amount << " from " << t_processed.sender << " to "
-                 << t_processed.recipient << ".\n";
+private:
+    static const size_t CHUNK_SIZE = 1 << 20;
+
+    // keep the unfinished line and read more behind it
+    void refill() {
+        size_t pending = end - pos;
+        if (pos > 0) {
+            memmove(buffer.data(), buffer.data() + pos, pending);
+            pos = 0;
+            end = pending;
+        }
+        if (buffer.size() - end < CHUNK_SIZE / 2) buffer.resize(buffer.size() * 2);
+        if (wake_fd >= 0) {
+            pollfd fds[2] = {{fd, POLLIN, 0}, {wake_fd, POLLIN, 0}};
+            while (poll(fds, 2, -1) < 0 && errno == EINTR) {}
+            if (fds[1].revents) {
+                eof = true;
+                return;
+            }
+        }
+        ssize_t got = read(fd, buffer.data() + end, buffer.size() - end);
+        if (got <= 0) {
+            eof = true;
+            return;
         }
+        end += static_cast<size_t>(got);
     }
-}
-// PLACE TRANSACTION
-void placeTransaction(const vector<string>& args) {
-    // Parse arguments
-    string timestamp = args[0];
-    current_timestamp = timestamp;
-    string ip = args[1];
-    string sender = args[2];
-    string recipient = args[3];
-    uint32_t amount = static_cast<uint32_t>(stoul(args[4]));
-    string exec_date = args[5];
-    char fee_type = args[6][0];
 
-    uint64_t place_time = stoull(removeColonsAndLeadingZeros(timestamp));
-    uint64_t exec_time = stoull(removeColonsAndLeadingZeros(exec_date));
+    int fd;
+    int wake_fd = -1;
+    MappedFile file;
+    vector<char> buffer;
+    size_t pos = 0;
+    size_t end = 0;
+    bool eof = false;
+};
 
-    // Error 1: Timestamp earlier than previous place command
-    if (!last_place_timestamp.empty() &&
-        place_time < stoull(removeColonsAndLeadingZeros(last_place_timestamp))) {
-        cerr << "Invalid decreasing timestamp in 'place' command.\n";
-        exit(1);
+// Whitespace-separated tokens of one command line, viewing into the line.
+// count includes tokens past MAX_TOKENS, which are not kept.
+struct Tokens {
+    static const size_t MAX_TOKENS = 8;
+    string_view items[MAX_TOKENS];
+    size_t count = 0;
+
+    // missing tokens read as empty, like extracting past the end of a stream
+    string_view operator[](size_t i) const {
+        return i < MAX_TOKENS ? items[i] : string_view();
     }
+};
 
-    // Error 2: Execution date before current timestamp
-    if (exec_time < place_time) {
-        cerr << "You cannot have an execution date before the current timestamp.\n";
-        exit(1);
+void tokenize(string_view line, Tokens& tokens) {
+    tokens = Tokens();
+    size_t i = 0;
+    while (true) {
+        while (i < line.size() && isspace(static_cast<unsigned char>(line[i]))) ++i;
+        if (i == line.size()) return;
+        size_t start = i;
+        while (i < line.size() && !isspace(static_cast<unsigned char>(line[i]))) ++i;
+        if (tokens.count < Tokens::MAX_TOKENS) tokens.items[tokens.count] = line.substr(start, i - start);
+        ++tokens.count;
     }
+}
 
-    // 1. Check sender is different from recipient
-    if (sender == recipient) {
-        if (verbose) cout << "Self transactions are not allowed.\n";
-        return;
+// An operation command parsed and resolved as far as it can be without
+// engine state: user ids looked up, IPs packed, numbers and timestamps
+// parsed. Text fields view into the command's line.
+struct OperationCommand {
+    enum Type : uint8_t { NONE, LOGIN, LOGOUT, BALANCE, PLACE, BAD_PLACE };
+
+    Type type = NONE;
+    string_view user_id; // the sender for place
+    string_view pin;
+    string_view recipient;
+    AccountId account = NO_ACCOUNT;
+    AccountId recipient_account = NO_ACCOUNT;
+    IpAddress ip;
+    Timestamp place_timestamp;
+    Timestamp exec_timestamp;
+    uint32_t amount = 0;
+    char fee_type = 0;
+};
+
+// Lines that are not operations come out as NONE, a place with the wrong
+// number of tokens as BAD_PLACE
+void parseOperation(const Tokens& args, OperationCommand& op) {
+    op.type = OperationCommand::NONE;
+    string_view command = args[0];
+    if (command.empty()) return;
+    switch (command[0]) {
+        case 'l':
+            if (command != "login") break;
+            op.type = OperationCommand::LOGIN;
+            op.user_id = args[1];
+            op.account = accounts.find(args[1]);
+            op.pin = args[2];
+            op.ip = IpAddress::parse(args[3]);
+            break;
+        case 'o':
+        case 'b':
+            if (command != "out" && command != "balance") break;
+            op.type = command[0] == 'o' ? OperationCommand::LOGOUT : OperationCommand::BALANCE;
+            op.user_id = args[1];
+            op.account = accounts.find(args[1]);
+            op.ip = IpAddress::lookup(args[2]);
+            break;
+        case 'p':
+            if (command != "place") break;
+            if (args.count != 8) {
+                op.type = OperationCommand::BAD_PLACE;
+                break;
+            }
+            // place <timestamp> <ip> <sender> <recipient> <amount> <exec_date> <o/s>
+            op.type = OperationCommand::PLACE;
+            op.place_timestamp = Timestamp::parse(args[1]);
+            op.ip = IpAddress::lookup(args[2]);
+            op.user_id = args[3];
+            op.account = accounts.find(args[3]);
+            op.recipient = args[4];
+            op.recipient_account = accounts.find(args[4]);
+            op.amount = parseUnsigned(args[5]);
+            op.exec_timestamp = Timestamp::parse(args[6]);
+            op.fee_type = args[7][0];
+            break;
+        default:
+            break;
     }
+}
 
-    // 2. Check execution date is within 3 days
-    if (exec_time - place_time > 3000000) {
-        if (verbose) cout << "Select a time up to three days in the future.\n";
-        return;
+// Binary command files (--binary), written by bench/command_convert from a
+// text command file so repeated replays skip text parsing. The layout is a
+// CommandFileHeader, string_count + 1 uint32 offsets into the string bytes
+// (offset i is where string i starts), the string bytes, then record_count
+// CommandRecords. User ids, pins and IPs are string indices; timestamps are
+// stored already parsed, and string 0 is always "" so unused fields can
+// point at it. Host byte order throughout.
+const char COMMAND_FILE_MAGIC[8] = {'B', 'A', 'N', 'K', 'C', 'M', 'D', 'S'};
+const uint32_t COMMAND_FILE_VERSION = 1;
+
+struct CommandFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t string_count;
+    uint64_t string_bytes;
+    uint64_t record_count;
+};
+static_assert(sizeof(CommandFileHeader) == 32, "CommandFileHeader is 32 bytes on disk");
+
+// One command line that the engine would act on
+struct CommandRecord {
+    enum Type : uint8_t { LOGIN, LOGOUT, BALANCE, PLACE, BAD_PLACE, QUERY, QUERIES_FOLLOW, RECORD_TYPES };
+
+    uint64_t timestamp;      // place time; x for l, r and s
+    uint64_t exec_timestamp; // execution time; y for l and r
+    uint32_t user;           // user id, or the sender for place
+    uint32_t other;          // pin for login, recipient for place
+    uint32_t ip;
+    uint32_t amount;
+    uint8_t type;
+    char detail;             // fee type for place, the query letter for QUERY
+    uint8_t padding[6];
+};
+static_assert(sizeof(CommandRecord) == 40, "CommandRecord is 40 bytes on disk");
+
+// Reads a binary command file from an fd: mapped when it is a regular file,
+// read whole otherwise. User ids are looked up once per string; IPs are
+// resolved on first use with the same parse/lookup split as the text
+// commands, since IpAddress::parse interns names that a later lookup of the
+// same text has to find.
+class BinaryCommands {
+public:
+    explicit BinaryCommands(int fd) {
+        if (file.map(fd)) {
+            data = file.data();
+            size = file.size();
+        } else {
+            char chunk[1 << 16];
+            ssize_t got;
+            while ((got = read(fd, chunk, sizeof(chunk))) != 0) {
+                if (got < 0) {
+                    if (errno == EINTR) continue;
+                    break;
+                }
+                contents.insert(contents.end(), chunk, chunk + got);
+            }
+            data = contents.data();
+            size = contents.size();
+        }
+        load();
     }
 
-    // 3. Check sender exists
-    if (users.count(sender) == 0) {
-        if (verbose) cout << "Sender " << sender << " does not exist.\n";
-        return;
+    // false once every record has been read
+    bool next(CommandRecord& record) {
+        if (next_record == record_count) return false;
+        memcpy(&record, records + next_record * sizeof(CommandRecord), sizeof(CommandRecord));
+        ++next_record;
+        return true;
     }
 
-    // 4. Check recipient exists
-    if (users.count(recipient) == 0) {
-        if (verbose) cout << "Recipient " << recipient << " does not exist.\n";
-        return;
+    string_view text(uint32_t index) const {
+        return string_view(strings + offsets[index], offsets[index + 1] - offsets[index]);
     }
 
-    // 5. Check registration dates are BEFORE OR EQUAL to execution time
-    uint64_t sender_reg = stoull(removeColonsAndLeadingZeros(users[sender].reg_timestamp));
-    uint64_t recipient_reg = stoull(removeColonsAndLeadingZeros(users[recipient].reg_timestamp));
-    if (exec_time < sender_reg || exec_time < recipient_reg) {
-        if (verbose) cout << "At the time of execution, sender and/or recipient have not registered.\n";
-        return;
+    // the OperationCommand parseOperation would make from the record's line
+    void decodeOperation(const CommandRecord& record, OperationCommand& op) {
+        op.type = OperationCommand::NONE;
+        switch (record.type) {
+            case CommandRecord::LOGIN:
+                op.type = OperationCommand::LOGIN;
+                op.user_id = text(record.user);
+                op.account = account_ids[record.user];
+                op.pin = text(record.other);
+                op.ip = loginIp(record.ip);
+                break;
+            case CommandRecord::LOGOUT:
+            case CommandRecord::BALANCE:
+                op.type = record.type == CommandRecord::LOGOUT ? OperationCommand::LOGOUT : OperationCommand::BALANCE;
+                op.user_id = text(record.user);
+                op.account = account_ids[record.user];
+                op.ip = sessionIp(record.ip);
+                break;
+            case CommandRecord::PLACE:
+                op.type = OperationCommand::PLACE;
+                op.place_timestamp = Timestamp(record.timestamp);
+                op.ip = sessionIp(record.ip);
+                op.user_id = text(record.user);
+                op.account = account_ids[record.user];
+                op.recipient = text(record.other);
+                op.recipient_account = account_ids[record.other];
+                op.amount = record.amount;
+                op.exec_timestamp = Timestamp(record.exec_timestamp);
+                op.fee_type = record.detail;
+                break;
+            case CommandRecord::BAD_PLACE:
+                op.type = OperationCommand::BAD_PLACE;
+                break;
+            default:
+                break;
+        }
     }
 
-    // 6. Check sender is logged in
-    if (!users[sender].logged_in) {
-        if (verbose) cout << "Sender " << sender << " is not logged in.\n";
-        return;
+private:
+    [[noreturn]] static void corrupt() {
+        cerr << "Error: Binary command input is truncated or corrupt.\n";
+        exit(1);
     }
 
-    // 7. Check fraudulent transaction
-    if (users[sender].active_ips.count(ip) == 0) {
-        if (verbose) cout << "Fraudulent transaction detected, aborting request.\n";
-        return;
+    // check the header, string table and every record's string indices
+    void load() {
+        CommandFileHeader header;
+        if (size < sizeof(header)) corrupt();
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, COMMAND_FILE_MAGIC, sizeof(COMMAND_FILE_MAGIC)) != 0) {
+            cerr << "Error: Input is not a binary command file.\n";
+            exit(1);
+        }
+        if (header.version != COMMAND_FILE_VERSION) {
+            cerr << "Error: Unsupported binary command file version " << header.version << ".\n";
+            exit(1);
+        }
+
+        size_t offsets_size = (static_cast<size_t>(header.string_count) + 1) * sizeof(uint32_t);
+        size_t pos = sizeof(header);
+        if (size - pos < offsets_size) corrupt();
+        offsets.resize(header.string_count + 1);
+        memcpy(offsets.data(), data + pos, offsets_size);
+        pos += offsets_size;
+        if (size - pos < header.string_bytes || offsets[0] != 0 || offsets.back() != header.string_bytes) corrupt();
+        for (size_t i = 0; i < header.string_count; ++i) {
+            if (offsets[i] > offsets[i + 1]) corrupt();
+        }
+        strings = data + pos;
+        pos += header.string_bytes;
+        if ((size - pos) / sizeof(CommandRecord) != header.record_count || (size - pos) % sizeof(CommandRecord)) {
+            corrupt();
+        }
+        records = data + pos;
+        record_count = header.record_count;
+
+        CommandRecord record;
+        while (next(record)) {
+            if (record.type >= CommandRecord::RECORD_TYPES || record.user >= header.string_count ||
+                record.other >= header.string_count || record.ip >= header.string_count) {
+                corrupt();
+            }
+        }
+        next_record = 0;
+
+        account_ids.resize(header.string_count);
+        for (uint32_t i = 0; i < header.string_count; ++i) account_ids[i] = accounts.find(text(i));
+        ips.resize(header.string_count);
+        ip_known.assign(header.string_count, 0);
     }
 
-    // All checks passed — update last_place_timestamp
-    last_place_timestamp = timestamp;
+    IpAddress loginIp(uint32_t index) {
+        if (!ip_known[index]) {
+            ips[index] = IpAddress::parse(text(index));
+            ip_known[index] = 1;
+        }
+        return ips[index];
+    }
 
+    // text that was never logged in from matches no session until it is
+    IpAddress sessionIp(uint32_t index) {
+        if (ip_known[index]) return ips[index];
+        IpAddress ip = IpAddress::lookup(text(index));
+        if (!ip.unknown()) {
+            ips[index] = ip;
+            ip_known[index] = 1;
+        }
+        return ip;
+    }
 
-    // Process transactions that are due
-    processTransactions();
+    MappedFile file;
+    vector<char> contents;
+    const char* data = nullptr;
+    size_t size = 0;
+    vector<uint32_t> offsets;
+    const char* strings = nullptr;
+    const char* records = nullptr;
+    size_t record_count = 0;
+    size_t next_record = 0;
+    vector<AccountId> account_ids;
+    vector<IpAddress> ips;
+    vector<char> ip_known;
+};
 
-    // Create and queue the new transaction
-    Transaction t(timestamp, exec_date, sender, recipient, amount, fee_type);
-    transaction_queue.push(t);
+// ---INPUT---
 
-    if (verbose) {
-        cout << "Transaction " << t.id << " placed at "
-             << removeColonsAndLeadingZeros(timestamp)
-             << ": $" << amount << " from " << sender
-             << " to " << recipient << " at "
-             << removeColonsAndLeadingZeros(exec_date) << ".\n";
+// ---OUTPUT---
+
+// write() all of data, retrying short writes; false on error
+bool writeAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
     }
+    return true;
 }
 
-// ---TRANSACTION_FUNCTIONS---
+// All report and verbose output is formatted straight into one large buffer
+// that goes out with a write() whenever it fills up, and once more at exit.
+// A default-constructed buffer has no fd and just grows in memory, which is
+// how queries evaluated on other threads collect their output.
+class OutputBuffer {
+public:
+    OutputBuffer() : buffer(256) {}
+    explicit OutputBuffer(int fd) : fd(fd), buffer(CAPACITY) {}
 
-// ---QUERY_FUNCTIONS---
+    ~OutputBuffer() { flush(); }
+
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+    OutputBuffer& operator<<(string_view text) {
+        memcpy(reserve(text.size()), text.data(), text.size());
+        used += text.size();
+        return *this;
+    }
+
+    OutputBuffer& operator<<(const char* text) { return *this << string_view(text); }
+
+    OutputBuffer& operator<<(char c) {
+        *reserve(1) = c;
+        ++used;
+        return *this;
+    }
+
+    template <typename T>
+    enable_if_t<is_integral_v<T> && !is_same_v<T, char> && !is_same_v<T, bool>, OutputBuffer&>
+    operator<<(T value) {
+        char* start = reserve(24);
+        used += static_cast<size_t>(to_chars(start, start + 24, value).ptr - start);
+        return *this;
+    }
+
+    // everything written so far (in-memory buffers only)
+    string_view contents() const { return string_view(buffer.data(), used); }
+
+    void clear() { used = 0; }
+
+    // flush, then send later output to another fd (-1 keeps it in memory)
+    void redirect(int new_fd) {
+        flush();
+        fd = new_fd;
+    }
+
+    void flush() {
+        if (fd < 0) return;
+        writeAll(fd, buffer.data(), used);
+        used = 0;
+    }
+
+private:
+    static const size_t CAPACITY = 1 << 20;
+
+    // room for count more bytes, flushing to the fd or growing as needed
+    char* reserve(size_t count) {
+        if (count > buffer.size() - used) {
+            flush();
+            if (count > buffer.size() - used) buffer.resize(max(buffer.size() * 2, used + count));
+        }
+        return buffer.data() + used;
+    }
+
+    int fd = -1;
+    vector<char> buffer;
+    size_t used = 0;
+};
+OutputBuffer output(STDOUT_FILENO);
+
+// print in the output form (no colons, no leading zeros)
+OutputBuffer& operator<<(OutputBuffer& out, Timestamp ts) {
+    return out << ts.value;
+}
+
+// "id: sender sent N dollars to recipient at T." row shared by every query
+void writeTransactionRow(OutputBuffer& out, const Transaction& t) {
+    out << t.id << ": " << accounts.user_ids[t.sender] << " sent " << t.amount
+        << " dollar" << (t.amount != 1 ? "s" : "") << " to " << accounts.user_ids[t.recipient]
+        << " at " << t.exec_timestamp << ".\n";
+}
+
+// Format time interval for revenue reporting: the difference of two packed
+// timestamps, read as yymmddhhmmss, as "1 year 2 months ..." skipping zeros
+void writeTimeInterval(OutputBuffer& out, uint64_t start, uint64_t end) {
+    static const char* const words[] = {" year", " month", " day", " hour", " minute", " second"};
+    uint64_t difference = end - start;
+    uint64_t divisor = 10000000000;
+    bool first = true;
+    for (const char* word : words) {
+        uint64_t part = difference / divisor % 100;
+        divisor /= 100;
+        if (part == 0) continue;
+        if (!first) out << ' ';
+        out << part << word;
+        if (part != 1) out << 's';
+        first = false;
+    }
+}
+
+// ---OUTPUT---
+
+// ---STATS---
+
+// Counts of values in power-of-two buckets (bucket b holds [2^(b-1), 2^b),
+// bucket 0 holds 0). Updates are relaxed atomics so query threads can
+// record into the same histogram.
+struct Histogram {
+    static const size_t BUCKETS = 64;
+
+    atomic<uint64_t> buckets[BUCKETS] = {};
+    atomic<uint64_t> count{0};
+    atomic<uint64_t> total{0};
+    atomic<uint64_t> maximum{0};
+
+    void add(uint64_t value) {
+        size_t bucket = value ? 64 - static_cast<size_t>(__builtin_clzll(value)) : 0;
+        buckets[min(bucket, BUCKETS - 1)].fetch_add(1, memory_order_relaxed);
+        count.fetch_add(1, memory_order_relaxed);
+        total.fetch_add(value, memory_order_relaxed);
+        uint64_t seen = maximum.load(memory_order_relaxed);
+        while (value > seen && !maximum.compare_exchange_weak(seen, value, memory_order_relaxed)) {}
+    }
+
+    // upper bound of the bucket holding the given fraction of values
+    uint64_t percentile(double fraction) const {
+        uint64_t total_count = count.load(memory_order_relaxed);
+        uint64_t wanted = static_cast<uint64_t>(fraction * static_cast<double>(total_count));
+        uint64_t seen = 0;
+        for (size_t b = 0; b < BUCKETS; ++b) {
+            seen += buckets[b].load(memory_order_relaxed);
+            if (seen > wanted) return b ? (1ull << b) - 1 : 0;
+        }
+        return maximum.load(memory_order_relaxed);
+    }
+
+    // {"count":..,"total":..,"max":..,"p50":..,"p90":..,"p99":..,"buckets":[[upper,count],..]}
+    void write(OutputBuffer& out) const {
+        out << "{\"count\":" << count.load() << ",\"total\":" << total.load() << ",\"max\":" << maximum.load()
+            << ",\"p50\":" << percentile(0.5) << ",\"p90\":" << percentile(0.9) << ",\"p99\":" << percentile(0.99)
+            << ",\"buckets\":[";
+        bool first = true;
+        for (size_t b = 0; b < BUCKETS; ++b) {
+            uint64_t n = buckets[b].load();
+            if (n == 0) continue;
+            if (!first) out << ',';
+            out << '[' << (b ? (1ull << b) - 1 : 0) << ',' << n << ']';
+            first = false;
+        }
+        out << "]}";
+    }
+};
+
+uint64_t statsNanos() {
+    return static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// --stats: per-command latency, placeTransaction outcomes by check, and the
+// shape of the pending queue and its drains. Nothing is timed or counted
+// unless enabled.
+struct EngineStats {
+    enum Command { LOGIN, LOGOUT, BALANCE, PLACE, QUERY_L, QUERY_R, QUERY_H, QUERY_S, COMMAND_TYPES };
+    // the checks in placeTransaction that drop a place command, in order
+    enum Rejection { SELF_TRANSACTION, EXEC_TOO_LATE, NO_SENDER, NO_RECIPIENT, NOT_REGISTERED,
+                     NOT_LOGGED_IN, FRAUD, REJECTION_TYPES };
+
+    bool enabled = false;
+    Histogram latency[COMMAND_TYPES]; // nanoseconds
+    uint64_t placed = 0;
+    uint64_t rejected[REJECTION_TYPES] = {};
+    uint64_t executed = 0;
+    uint64_t insufficient_funds = 0;
+    Histogram queue_depth; // pending transactions after each placement
+    Histogram drain_size;  // transactions settled per processTransactions call
+    Histogram drain_latency; // nanoseconds per processTransactions call
+
+    // where to record a command's latency, or nullptr when disabled
+    Histogram* latencyOf(Command command) { return enabled ? &latency[command] : nullptr; }
+
+    void reject(Rejection reason) {
+        if (enabled) ++rejected[reason];
+    }
+
+    void write(OutputBuffer& out) const {
+        static const char* const command_names[] = {"login", "out", "balance", "place", "l", "r", "h", "s"};
+        static const char* const rejection_names[] = {"self_transaction", "exec_too_late", "no_sender",
+                                                      "no_recipient", "not_registered", "not_logged_in",
+                                                      "fraud"};
+        out << "{\"latency_ns\":{";
+        for (size_t i = 0; i < COMMAND_TYPES; ++i) {
+            out << (i ? ",\"" : "\"") << command_names[i] << "\":";
+            latency[i].write(out);
+        }
+        out << "},\"place\":{\"placed\":" << placed << ",\"rejected\":{";
+        for (size_t i = 0; i < REJECTION_TYPES; ++i) {
+            out << (i ? ",\"" : "\"") << rejection_names[i] << "\":" << rejected[i];
+        }
+        out << "}},\"settlement\":{\"executed\":" << executed << ",\"insufficient_funds\":" << insufficient_funds
+            << "},\"queue_depth\":";
+        queue_depth.write(out);
+        out << ",\"drain_size\":";
+        drain_size.write(out);
+        out << ",\"drain_latency_ns\":";
+        drain_latency.write(out);
+        out << "}\n";
+    }
+};
+EngineStats stats;
+
+// Records the time until the end of the scope into a histogram (if any)
+class ScopedLatency {
+public:
+    explicit ScopedLatency(Histogram* histogram) : histogram(histogram), start(histogram ? statsNanos() : 0) {}
+    ~ScopedLatency() {
+        if (histogram) histogram->add(statsNanos() - start);
+    }
+
+    ScopedLatency(const ScopedLatency&) = delete;
+    ScopedLatency& operator=(const ScopedLatency&) = delete;
+
+private:
+    Histogram* histogram;
+    uint64_t start;
+};
+
+void writeStatsReport(const string& filename) {
+    int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        cerr << "Error: Could not open stats file " << filename << "\n";
+        exit(1);
+    }
+    {
+        OutputBuffer out(fd);
+        stats.write(out);
+    }
+    ::close(fd);
+}
+
+// ---STATS---
+
+// ---FORWARD_DECLARATIONS---
+
+struct Transaction;
+struct AccountTable;
+// Global variables;
+Timestamp current_timestamp;
+Timestamp last_place_timestamp;
+TransactionScheduler transaction_queue;
+// Executed transactions: the single append-only store that per-user
+// histories index into. Kept ordered by (exec_timestamp, id) so interval
+// queries can binary search instead of scanning
+vector<Transaction> transaction_history;
+FeeIndex fee_index;
+DayRollups day_rollups;
+
+// Everything the queries read. The engine's view is of the globals above;
+// live queries (--live-queries) read a replica kept on another thread.
+struct LedgerView {
+    const vector<Transaction>& history;
+    const FeeIndex& fees;
+    const DayRollups& days;
+    const vector<RecentHistory>& incoming;
+    const vector<RecentHistory>& outgoing;
+    const vector<uint32_t>& balances;
+};
+const LedgerView engine_ledger = {transaction_history, fee_index, day_rollups,
+                                  accounts.incoming, accounts.outgoing, accounts.balances};
+
+// Placements and executions since live queries last caught up, collected
+// only while they are running
+struct LedgerChanges {
+    bool recording = false;
+    vector<Timestamp> placements;
+    vector<Transaction> executed;
+};
+LedgerChanges ledger_changes;
+
+// ---FORWARD_DECLARATIONS---
+
+// ---DIAGNOSTICS---
+
+// The command handlers are templates over a diagnostics sink, chosen once
+// per command from the command line: TextDiagnostics (--verbose) writes the
+// messages to stdout, EventDiagnostics (--events) appends binary records to
+// a file, and QuietDiagnostics drops everything, so the quiet handlers are
+// compiled with no diagnostic branches or formatting at all.
+//
+// CHECKS_BALANCE_SESSION is the sink's balance policy: with it, a balance
+// command for an account that is logged out, or not logged in from this IP,
+// is refused; without it any existing account's balance is reported.
+// Verbose mode has always enforced this and --events, its binary
+// counterpart, does too; the quiet engine never has.
+// tests/balance_policy.sh checks the policy end to end in all three modes.
+
+// One --events record per diagnostic, 32 bytes, host byte order
+struct DiagnosticEvent {
+    enum Type : uint8_t { LOGIN_FAILED, LOGGED_IN, LOGOUT_FAILED, LOGGED_OUT, UNKNOWN_USER,
+                          BALANCE_NOT_LOGGED_IN, BALANCE_FRAUD, PLACE_REJECTED, PLACED,
+                          INSUFFICIENT_FUNDS, EXECUTED };
+
+    uint64_t timestamp;     // current time; execution time for settlements
+    int32_t transaction_id; // -1 when there is no transaction yet
+    uint32_t account;       // the user or sender, NO_ACCOUNT when unknown
+    uint32_t recipient;     // NO_ACCOUNT unless a transaction is involved
+    uint32_t amount;
+    uint8_t type;
+    uint8_t rejection;      // EngineStats::Rejection for PLACE_REJECTED
+    uint8_t padding[6];
+};
+static_assert(sizeof(DiagnosticEvent) == 32, "DiagnosticEvent records are 32 bytes on disk");
+
+class EventLog {
+public:
+    void open(const string& filename) {
+        int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            cerr << "Error: Could not open events file " << filename << "\n";
+            exit(1);
+        }
+        buffer = make_unique<OutputBuffer>(fd);
+    }
+
+    bool enabled() const { return buffer != nullptr; }
+
+    void append(DiagnosticEvent::Type type, AccountId account, AccountId recipient = NO_ACCOUNT,
+                const Transaction* t = nullptr, uint8_t rejection = 0) {
+        DiagnosticEvent event = {};
+        event.timestamp = t && type != DiagnosticEvent::PLACED ? t->exec_timestamp.value : current_timestamp.value;
+        event.transaction_id = t ? t->id : -1;
+        event.account = account;
+        event.recipient = recipient;
+        event.amount = t ? t->amount : 0;
+        event.type = type;
+        event.rejection = rejection;
+        *buffer << string_view(reinterpret_cast<const char*>(&event), sizeof(event));
+    }
+
+private:
+    unique_ptr<OutputBuffer> buffer;
+};
+EventLog event_log;
+
+struct TextDiagnostics {
+    static const bool CHECKS_BALANCE_SESSION = true;
+
+    static void loginFailed(string_view user_id, AccountId) { output << "Login failed for " << user_id << ".\n"; }
+    static void loggedIn(string_view user_id, AccountId) { output << "User " << user_id << " logged in.\n"; }
+    static void logoutFailed(string_view user_id, AccountId) { output << "Logout failed for " << user_id << ".\n"; }
+    static void loggedOut(string_view user_id, AccountId) { output << "User " << user_id << " logged out.\n"; }
+    static void unknownUser(string_view user_id) { output << "User " << user_id << " does not exist.\n"; }
+    static void balanceNotLoggedIn(string_view user_id, AccountId) {
+        output << "User " << user_id << " is not logged in.\n";
+    }
+    static void balanceFraud(AccountId) { output << "Fraudulent balance check detected, aborting request.\n"; }
+
+    static void placeRejected(EngineStats::Rejection reason, const OperationCommand& op) {
+        switch (reason) {
+            case EngineStats::SELF_TRANSACTION:
+                output << "Self transactions are not allowed.\n";
+                break;
+            case EngineStats::EXEC_TOO_LATE:
+                output << "Select a time up to three days in the future.\n";
+                break;
+            case EngineStats::NO_SENDER:
+                output << "Sender " << op.user_id << " does not exist.\n";
+                break;
+            case EngineStats::NO_RECIPIENT:
+                output << "Recipient " << op.recipient << " does not exist.\n";
+                break;
+            case EngineStats::NOT_REGISTERED:
+                output << "At the time of execution, sender and/or recipient have not registered.\n";
+                break;
+            case EngineStats::NOT_LOGGED_IN:
+                output << "Sender " << op.user_id << " is not logged in.\n";
+                break;
+            case EngineStats::FRAUD:
+                output << "Fraudulent transaction detected, aborting request.\n";
+                break;
+            default:
+                break;
+        }
+    }
+
+    static void placed(const Transaction& t, const OperationCommand& op) {
+        output << "Transaction " << t.id << " placed at " << t.place_timestamp << ": $" << t.amount
+               << " from " << op.user_id << " to " << op.recipient << " at " << t.exec_timestamp << ".\n";
+    }
+
+    static void insufficientFunds(const Transaction& t) {
+        output << "Insufficient funds to process transaction " << t.id << ".\n";
+    }
+
+    static void executed(const Transaction& t) {
+        output << "Transaction " << t.id << " executed at " << t.exec_timestamp << ": $" << t.amount << " from "
+               << accounts.user_ids[t.sender] << " to " << accounts.user_ids[t.recipient] << ".\n";
+    }
+};
+
+struct EventDiagnostics {
+    static const bool CHECKS_BALANCE_SESSION = true;
+
+    static void loginFailed(string_view, AccountId id) { event_log.append(DiagnosticEvent::LOGIN_FAILED, id); }
+    static void loggedIn(string_view, AccountId id) { event_log.append(DiagnosticEvent::LOGGED_IN, id); }
+    static void logoutFailed(string_view, AccountId id) { event_log.append(DiagnosticEvent::LOGOUT_FAILED, id); }
+    static void loggedOut(string_view, AccountId id) { event_log.append(DiagnosticEvent::LOGGED_OUT, id); }
+    static void unknownUser(string_view) { event_log.append(DiagnosticEvent::UNKNOWN_USER, NO_ACCOUNT); }
+    static void balanceNotLoggedIn(string_view, AccountId id) {
+        event_log.append(DiagnosticEvent::BALANCE_NOT_LOGGED_IN, id);
+    }
+    static void balanceFraud(AccountId id) { event_log.append(DiagnosticEvent::BALANCE_FRAUD, id); }
+
+    static void placeRejected(EngineStats::Rejection reason, const OperationCommand& op) {
+        event_log.append(DiagnosticEvent::PLACE_REJECTED, op.account, op.recipient_account, nullptr,
+                         static_cast<uint8_t>(reason));
+    }
+
+    static void placed(const Transaction& t, const OperationCommand&) {
+        event_log.append(DiagnosticEvent::PLACED, t.sender, t.recipient, &t);
+    }
+
+    static void insufficientFunds(const Transaction& t) {
+        event_log.append(DiagnosticEvent::INSUFFICIENT_FUNDS, t.sender, t.recipient, &t);
+    }
+
+    static void executed(const Transaction& t) {
+        event_log.append(DiagnosticEvent::EXECUTED, t.sender, t.recipient, &t);
+    }
+};
+
+struct QuietDiagnostics {
+    static const bool CHECKS_BALANCE_SESSION = false;
+
+    static void loginFailed(string_view, AccountId) {}
+    static void loggedIn(string_view, AccountId) {}
+    static void logoutFailed(string_view, AccountId) {}
+    static void loggedOut(string_view, AccountId) {}
+    static void unknownUser(string_view) {}
+    static void balanceNotLoggedIn(string_view, AccountId) {}
+    static void balanceFraud(AccountId) {}
+    static void placeRejected(EngineStats::Rejection, const OperationCommand&) {}
+    static void placed(const Transaction&, const OperationCommand&) {}
+    static void insufficientFunds(const Transaction&) {}
+    static void executed(const Transaction&) {}
+};
+
+// ---DIAGNOSTICS---
+
+
+// What the sender pays: the amount plus all of the fee, or the larger half
+// of it when the fee is shared
+uint32_t senderTotal(const Transaction& t) {
+    return t.amount + (t.fee_type == 'o' ? t.fee : (t.fee + 1) / 2);
+}
+
+// What the recipient pays towards a shared fee
+uint32_t recipientTotal(const Transaction& t) {
+    return t.fee_type == 's' ? t.fee / 2 : 0;
+}
+
+// The writable side of a LedgerView: every update placing and executing
+// transactions makes to the ledger goes through here, whether to the
+// engine's globals (engine_tables) or to the live query replica, so the
+// copies cannot drift apart
+struct LedgerTables {
+    vector<Transaction>& history;
+    FeeIndex& fees;
+    DayRollups& days;
+    vector<RecentHistory>& incoming;
+    vector<RecentHistory>& outgoing;
+    vector<uint32_t>& balances;
+
+    void recordPlacement(Timestamp place_time) { fees.addPlacement(place_time); }
+
+    // Move the money for a transaction whose fee is set and funds are checked
+    void transfer(AccountId sender, AccountId recipient, uint32_t amount, uint32_t sender_total,
+                  uint32_t recipient_total) {
+        balances[sender] -= sender_total;
+        balances[recipient] += amount;
+        balances[recipient] -= recipient_total;
+    }
+
+    // Append an executed transaction to the history and index it in the fee
+    // index, the day rollups and both users' histories.
+    // processTransactions drains in (exec time, id) order, and anything
+    // placed later has a larger id and an exec time no earlier than the drain
+    // point, so appending keeps the store ordered.
+    void recordExecuted(const Transaction& t) {
+        history.push_back(t);
+        uint32_t index = static_cast<uint32_t>(history.size() - 1);
+        fees.addFee(t.id, t.fee);
+        days.addExecuted(t.exec_timestamp, index, t.fee);
+        outgoing[t.sender].add(index);
+        incoming[t.recipient].add(index);
+    }
+
+    // Both of the above for a transaction settled elsewhere
+    void applyExecuted(const Transaction& t) {
+        transfer(t.sender, t.recipient, t.amount, senderTotal(t), recipientTotal(t));
+        recordExecuted(t);
+    }
+};
+LedgerTables engine_tables = {transaction_history, fee_index, day_rollups,
+                              accounts.incoming, accounts.outgoing, accounts.balances};
+
+// First executed transaction at or after the given exec time
+vector<Transaction>::const_iterator historyLowerBound(const vector<Transaction>& history, Timestamp ts) {
+    return lower_bound(history.cbegin(), history.cend(), ts,
+                       [](const Transaction& t, Timestamp value) {
+                           return t.exec_timestamp < value;
+                       });
+}
+
+//---BIGGER_FUNCTIONS---
+
+// One parsed "timestamp|user_id|pin|balance" line; strings view into the file
+struct Registration {
+    string_view user_id;
+    string_view pin;
+    Timestamp reg_timestamp;
+    uint32_t balance = 0;
+};
+
+// next '|'-separated field of a registration line (empty once the line runs out)
+string_view nextField(string_view& rest, char separator) {
+    size_t stop = rest.find(separator);
+    string_view field = rest.substr(0, stop);
+    rest = (stop == string_view::npos) ? string_view() : rest.substr(stop + 1);
+    return field;
+}
+
+// Parse every line of one chunk of the registration file
+void parseRegistrations(string_view chunk, vector<Registration>& out) {
+    while (!chunk.empty()) {
+        string_view line = nextField(chunk, '\n');
+        if (line.empty()) continue;
+        
+        Registration reg;
+        reg.reg_timestamp = Timestamp::parse(nextField(line, '|'));
+        reg.user_id = nextField(line, '|');
+        reg.pin = nextField(line, '|');
+        reg.balance = parseUnsigned(line);
+        out.push_back(reg);
+    }
+}
+
+// LOAD REGISTRTIONS
+// The file is mapped and cut into chunks on line boundaries, chunks are
+// parsed on separate threads, and the account table is then filled in file
+// order in a single pre-sized pass.
+void loadRegistrationFile(const string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cerr << "Error: Could not open registration file " << filename << "\n";
+        exit(1);
+    }
+    
+    MappedFile file;
+    string contents; // only used when the file cannot be mapped
+    string_view text;
+    if (file.map(fd)) {
+        text = string_view(file.data(), file.size());
+    } else {
+        char chunk[1 << 16];
+        ssize_t got;
+        while ((got = read(fd, chunk, sizeof(chunk))) > 0) {
+            contents.append(chunk, static_cast<size_t>(got));
+        }
+        text = contents;
+    }
+    close(fd);
+    
+    // Split on line boundaries, at least 1 MiB per thread
+    const size_t MIN_CHUNK = 1 << 20;
+    size_t thread_count = min<size_t>(max(1u, thread::hardware_concurrency()),
+                                      text.size() / MIN_CHUNK + 1);
+    vector<string_view> chunks;
+    size_t begin = 0;
+    for (size_t i = 1; i <= thread_count && begin < text.size(); ++i) {
+        size_t stop = text.size() * i / thread_count;
+        if (i < thread_count) {
+            stop = text.find('\n', max(stop, begin));
+            stop = (stop == string_view::npos) ? text.size() : stop + 1;
+        }
+        chunks.push_back(text.substr(begin, stop - begin));
+        begin = stop;
+    }
+    
+    vector<vector<Registration>> parsed(chunks.size());
+    vector<thread> workers;
+    for (size_t i = 1; i < chunks.size(); ++i) {
+        workers.emplace_back(parseRegistrations, chunks[i], ref(parsed[i]));
+    }
+    if (!chunks.empty()) parseRegistrations(chunks[0], parsed[0]);
+    for (auto& worker : workers) worker.join();
+    
+    size_t total = 0;
+    for (const auto& part : parsed) total += part.size();
+    accounts.reserve(total);
+    
+    bool first_registration = true;
+    for (const auto& part : parsed) {
+        for (const Registration& reg : part) {
+            accounts.add(reg.user_id, reg.pin, reg.balance, reg.reg_timestamp);
+            
+            // Set initial current timestamp to first registration if not set
+            if (first_registration) {
+                current_timestamp = reg.reg_timestamp;
+                first_registration = false;
+            }
+        }
+    }
+}
+// LOGIN
+template <typename Diagnostics>
+void handleLogin(AccountId id, string_view user_id, string_view pin, IpAddress ip) {
+    if (id == NO_ACCOUNT) {
+        Diagnostics::loginFailed(user_id, id);
+        return;
+    }
+    
+    if (accounts.pins[id] != pin) {
+        Diagnostics::loginFailed(user_id, id);
+        return;
+    }
+    
+    accounts.sessions.insert(id, ip);
+    accounts.logged_in[id] = true;
+    Diagnostics::loggedIn(user_id, id);
+}
+// LOGOUT
+template <typename Diagnostics>
+void handleLogout(AccountId id, string_view user_id, IpAddress ip) {
+    if (id == NO_ACCOUNT) {
+        Diagnostics::logoutFailed(user_id, id);
+        return;
+    }
+    
+    if (!accounts.sessions.erase(id, ip)) {
+        Diagnostics::logoutFailed(user_id, id);
+        return;
+    }
+    
+    if(accounts.sessions.empty(id)) accounts.logged_in[id] = false;
+    Diagnostics::loggedOut(user_id, id);
+}
+// BALANCE
+template <typename Diagnostics>
+void handleBalance(AccountId id, string_view user_id, IpAddress ip) {
+    if (id == NO_ACCOUNT) {
+        Diagnostics::unknownUser(user_id);
+        return;
+    }
+
+    if constexpr (Diagnostics::CHECKS_BALANCE_SESSION) {
+        if (accounts.logged_in[id] == false) {
+            Diagnostics::balanceNotLoggedIn(user_id, id);
+            return;
+        }
+
+        if (!accounts.sessions.contains(id, ip)) {
+            Diagnostics::balanceFraud(id);
+            return;
+        }
+    }
+    
+    output << "As of " << current_timestamp << ", " << user_id 
+         << " has a balance of $" << accounts.balances[id] << ".\n";
+}
+
+// ---BIGGER_FUNCTIONS---
+
+// ---JOURNAL---
+
+// Append-only write-ahead journal of placements, executions and
+// insufficient-funds rejections. Records are fixed-size and checksummed.
+// They collect in memory and go out together as one write() (a group
+// commit) every sync_every records, followed by fdatasync(). With
+// sync_every == 0 the groups are GROUP_SIZE records and durability is left
+// to the OS. A crash loses at most the uncommitted group, and a torn
+// trailing record is discarded on the next start.
+//
+// The header ties the journal to the state it was started on (the
+// registration file or a snapshot) by account count and stateFingerprint(),
+// and a journal is only replayed onto that same state. Saving a snapshot
+// rotates the journal: it is emptied and restarted on the snapshot's state.
+const char JOURNAL_MAGIC[8] = {'B', 'A', 'N', 'K', 'J', 'R', 'N', 'L'};
+const uint32_t JOURNAL_VERSION = 1;
+
+struct JournalHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t padding;
+    uint64_t account_count;
+    uint64_t base_fingerprint;
+};
+static_assert(sizeof(JournalHeader) == 32, "JournalHeader is 32 bytes on disk");
+
+struct JournalRecord {
+    uint64_t place_timestamp;
+    uint64_t exec_timestamp;
+    int32_t id;
+    uint32_t sender;
+    uint32_t recipient;
+    uint32_t amount;
+    uint32_t fee;
+    char type; // 'P'laced, 'E'xecuted or 'R'ejected
+    char fee_type;
+    char padding[2];
+    uint32_t checksum;
+    uint32_t padding2;
+};
+static_assert(sizeof(JournalRecord) == 48, "JournalRecord is 48 bytes on disk");
+
+// FNV-1a over every byte before the checksum
+uint32_t journalChecksum(const JournalRecord& record) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&record);
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(JournalRecord, checksum); ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// FNV-1a over the accounts and the shape of the ledger, the part of the
+// engine state a journal replays onto
+uint64_t stateFingerprint() {
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; ++i) hash = (hash ^ bytes[i]) * 1099511628211ull;
+    };
+    for (AccountId id = 0; id < accounts.user_ids.size(); ++id) {
+        const string& user_id = accounts.user_ids[id];
+        const string& pin = accounts.pins[id];
+        mix(user_id.data(), user_id.size() + 1);
+        mix(pin.data(), pin.size() + 1);
+        mix(&accounts.reg_timestamps[id].value, sizeof(uint64_t));
+        mix(&accounts.balances[id], sizeof(uint32_t));
+    }
+    uint64_t shape[4] = {static_cast<uint64_t>(transaction_counter), transaction_history.size(),
+                         transaction_queue.size(), current_timestamp.value};
+    mix(shape, sizeof(shape));
+    return hash;
+}
+
+class Journal {
+public:
+    Journal() = default;
+
+    ~Journal() { close(); }
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    bool enabled() const { return fd >= 0; }
+
+    // Open (creating if needed) and return every intact record already in it.
+    // An existing journal has to have been started on the current state.
+    // A torn tail is cut off so new records append after the last good one.
+    vector<JournalRecord> open(const string& filename, size_t sync_interval, uint64_t account_count,
+                               uint64_t base_fingerprint) {
+        sync_every = sync_interval;
+        group_size = sync_every ? sync_every : GROUP_SIZE;
+        fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            cerr << "Error: Could not open journal file " << filename << "\n";
+            exit(1);
+        }
+        
+        vector<JournalRecord> records;
+        MappedFile file;
+        if (!file.map(fd)) {
+            // new or empty journal
+            writeHeader(account_count, base_fingerprint);
+            return records;
+        }
+        JournalHeader header;
+        if (file.size() < sizeof(header)) {
+            cerr << "Error: " << filename << " is not a journal file\n";
+            exit(1);
+        }
+        memcpy(&header, file.data(), sizeof(header));
+        if (memcmp(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0 || header.version != JOURNAL_VERSION) {
+            cerr << "Error: " << filename << " is not a version " << JOURNAL_VERSION << " journal file\n";
+            exit(1);
+        }
+        if (header.account_count != account_count || header.base_fingerprint != base_fingerprint) {
+            cerr << "Error: Journal " << filename << " was started on a different registration file or snapshot\n";
+            exit(1);
+        }
+        
+        size_t offset = sizeof(header);
+        while (offset + sizeof(JournalRecord) <= file.size()) {
+            JournalRecord record;
+            memcpy(&record, file.data() + offset, sizeof(record));
+            if (record.checksum != journalChecksum(record)) break;
+            records.push_back(record);
+            offset += sizeof(record);
+        }
+        if (ftruncate(fd, static_cast<off_t>(offset)) != 0 || lseek(fd, 0, SEEK_END) < 0) fail();
+        return records;
+    }
+
+    void recordPlacement(const Transaction& t) {
+        JournalRecord record = {};
+        record.type = 'P';
+        record.id = t.id;
+        record.place_timestamp = t.place_timestamp.value;
+        record.exec_timestamp = t.exec_timestamp.value;
+        record.sender = t.sender;
+        record.recipient = t.recipient;
+        record.amount = t.amount;
+        record.fee_type = t.fee_type;
+        append(record);
+    }
+
+    void recordExecution(int id, uint32_t fee) {
+        JournalRecord record = {};
+        record.type = 'E';
+        record.id = id;
+        record.fee = fee;
+        append(record);
+    }
+
+    void recordRejection(int id) {
+        JournalRecord record = {};
+        record.type = 'R';
+        record.id = id;
+        append(record);
+    }
+
+    // group commit: one write() for everything pending, then fdatasync()
+    void commit() {
+        if (pending.empty()) return;
+        if (!writeAll(fd, reinterpret_cast<const char*>(pending.data()), pending.size() * sizeof(JournalRecord))) fail();
+        if (sync_every && fdatasync(fd) != 0) fail();
+        pending.clear();
+    }
+
+    // Empty the journal and start it again on the current state, once a
+    // snapshot of that state is safely written
+    void rotate(uint64_t account_count, uint64_t base_fingerprint) {
+        pending.clear();
+        if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) < 0) fail();
+        writeHeader(account_count, base_fingerprint);
+    }
+
+    void close() {
+        if (fd < 0) return;
+        commit();
+        ::close(fd);
+        fd = -1;
+    }
+
+private:
+    static const size_t GROUP_SIZE = 4096;
+
+    void writeHeader(uint64_t account_count, uint64_t base_fingerprint) {
+        JournalHeader header = {};
+        memcpy(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+        header.version = JOURNAL_VERSION;
+        header.account_count = account_count;
+        header.base_fingerprint = base_fingerprint;
+        if (!writeAll(fd, reinterpret_cast<const char*>(&header), sizeof(header))) fail();
+        if (sync_every && fdatasync(fd) != 0) fail();
+    }
+
+    void append(JournalRecord& record) {
+        record.checksum = journalChecksum(record);
+        pending.push_back(record);
+        if (pending.size() >= group_size) commit();
+    }
+
+    [[noreturn]] void fail() {
+        cerr << "Error: Could not write journal file\n";
+        exit(1);
+    }
+
+    int fd = -1;
+    size_t sync_every = 0;
+    size_t group_size = GROUP_SIZE;
+    vector<JournalRecord> pending;
+};
+Journal journal;
+
+[[noreturn]] void journalMismatch(const JournalRecord& record) {
+    cerr << "Error: Journal record for transaction " << record.id << " does not fit the current state\n";
+    exit(1);
+}
+
+// Rebuild engine state from journal records on top of the registration
+// file or snapshot the journal was started from
+void replayJournal(const vector<JournalRecord>& records) {
+    // transactions still pending in a snapshot can settle in the journal too
+    // they are collected without draining, since draining advances the
+    // wheel past earlier exec times that get re-scheduled below
+    unordered_map<int, Transaction> placed;
+    transaction_queue.forEach([&placed](const Transaction& t) { placed.emplace(t.id, t); });
+    transaction_queue = TransactionScheduler();
+    
+    for (const JournalRecord& record : records) {
+        if (record.type == 'P') {
+            // placements are journaled in id order, continuing from the base state
+            if (record.id != transaction_counter || record.sender >= accounts.user_ids.size() ||
+                record.recipient >= accounts.user_ids.size()) {
+                journalMismatch(record);
+            }
+            Transaction t;
+            t.id = record.id;
+            t.place_timestamp = Timestamp(record.place_timestamp);
+            t.exec_timestamp = Timestamp(record.exec_timestamp);
+            t.sender = record.sender;
+            t.recipient = record.recipient;
+            t.amount = record.amount;
+            t.fee_type = record.fee_type;
+            engine_tables.recordPlacement(t.place_timestamp);
+            transaction_counter = t.id + 1;
+            current_timestamp = last_place_timestamp = t.place_timestamp;
+            placed.emplace(t.id, t);
+            continue;
+        }
+        
+        auto it = placed.find(record.id);
+        if (it == placed.end()) continue;
+        if (record.type == 'E') {
+            Transaction& t = it->second;
+            t.fee = record.fee;
+            t.executed = true;
+            engine_tables.applyExecuted(t);
+        }
+        placed.erase(it);
+    }
+    
+    // schedule the leftovers in id order so equal exec times stay id-ordered
+    vector<Transaction> pending;
+    for (const auto& entry : placed) pending.push_back(entry.second);
+    sort(pending.begin(), pending.end(), [](const Transaction& a, const Transaction& b) {
+        return a.id < b.id;
+    });
+    for (const Transaction& t : pending) transaction_queue.schedule(t);
+}
+
+// ---JOURNAL---
+
+// ---TRANSACTION_FUNCTIONS---
+
+// POCESS TRANSACTIONS
+// The due transactions drained by one processTransactions call. Fee inputs
+// are gathered into packed arrays so fees and both sides' totals for the
+// whole batch come out of one branch-free loop
+struct SettlementBatch {
+    vector<Transaction> transactions;
+    vector<uint32_t> amounts;
+    vector<uint64_t> exec_times;
+    vector<uint64_t> loyalty_times;
+    vector<uint32_t> shared_fees; // 1 when the fee is split
+    vector<uint32_t> fees;
+    vector<uint32_t> sender_totals;
+    vector<uint32_t> recipient_totals;
+
+    size_t size() const { return transactions.size(); }
+
+    void clear() {
+        transactions.clear();
+        amounts.clear();
+        exec_times.clear();
+        loyalty_times.clear();
+        shared_fees.clear();
+    }
+
+    void add(const Transaction& t) {
+        transactions.push_back(t);
+        amounts.push_back(t.amount);
+        exec_times.push_back(t.exec_timestamp.value);
+        loyalty_times.push_back(accounts.loyalty_timestamps[t.sender].value);
+        shared_fees.push_back(t.fee_type == 's');
+    }
+
+    // same arithmetic as senderTotal/recipientTotal, for every transaction
+    void computeFees() {
+        size_t n = size();
+        fees.resize(n);
+        sender_totals.resize(n);
+        recipient_totals.resize(n);
+        const uint32_t* amount = amounts.data();
+        const uint64_t* exec_time = exec_times.data();
+        const uint64_t* loyalty_time = loyalty_times.data();
+        const uint32_t* shared = shared_fees.data();
+        uint32_t* fee_out = fees.data();
+        uint32_t* sender_out = sender_totals.data();
+        uint32_t* recipient_out = recipient_totals.data();
+        for (size_t i = 0; i < n; ++i) {
+            uint32_t fee = transactionFee(amount[i], exec_time[i], loyalty_time[i]);
+            fee_out[i] = fee;
+            sender_out[i] = amount[i] + (shared[i] ? (fee + 1) / 2 : fee);
+            recipient_out[i] = shared[i] ? fee / 2 : 0;
+        }
+    }
+};
+
+// Settle one due transaction of the batch if both sides can pay
+bool settleTransaction(SettlementBatch& batch, size_t i) {
+    // (accounts are never removed, so both ids are still valid here)
+    Transaction& t = batch.transactions[i];
+    t.fee = batch.fees[i];
+    if (accounts.balances[t.sender] < batch.sender_totals[i] ||
+        accounts.balances[t.recipient] < batch.recipient_totals[i]) {
+        return false;
+    }
+    engine_tables.transfer(t.sender, t.recipient, t.amount, batch.sender_totals[i], batch.recipient_totals[i]);
+    return true;
+}
+
+// Worker threads kept for the life of the engine so sharded drains do not
+// start and join threads each time. run() calls work(shard) once for every
+// shard, shard 0 on the calling thread, and returns when all have finished.
+class ShardPool {
+public:
+    ShardPool() = default;
+
+    ~ShardPool() {
+        {
+            lock_guard<mutex> lock(mutex_);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : workers) t.join();
+    }
+
+    ShardPool(const ShardPool&) = delete;
+    ShardPool& operator=(const ShardPool&) = delete;
+
+    void run(size_t shard_count, const function<void(size_t)>& work) {
+        while (workers.size() + 1 < shard_count) {
+            size_t shard = workers.size() + 1;
+            workers.emplace_back([this, shard]() { loop(shard); });
+        }
+        {
+            lock_guard<mutex> lock(mutex_);
+            job = &work;
+            active_shards = shard_count;
+            remaining = shard_count - 1;
+            ++generation;
+        }
+        wake.notify_all();
+        work(0);
+        unique_lock<mutex> lock(mutex_);
+        finished.wait(lock, [this]() { return remaining == 0; });
+        job = nullptr;
+    }
+
+private:
+    void loop(size_t shard) {
+        uint64_t seen = 0;
+        unique_lock<mutex> lock(mutex_);
+        while (true) {
+            wake.wait(lock, [&]() { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            if (shard >= active_shards) continue;
+            const function<void(size_t)>* work = job;
+            lock.unlock();
+            (*work)(shard);
+            lock.lock();
+            if (--remaining == 0) finished.notify_one();
+        }
+    }
+
+    vector<thread> workers;
+    mutex mutex_;
+    condition_variable wake;
+    condition_variable finished;
+    const function<void(size_t)>* job = nullptr;
+    size_t active_shards = 0;
+    size_t remaining = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+};
+ShardPool shard_pool;
+
+// The latest transaction of the current batch to touch each account. Entries
+// are stamped with the batch's epoch, so starting a batch costs nothing
+// however many accounts there are, and stale entries read as untouched.
+class LastTouch {
+public:
+    static const int32_t NONE = -1;
+
+    void startBatch() {
+        if (stamps.size() < accounts.balances.size()) stamps.resize(accounts.balances.size(), 0);
+        if (++epoch == 0) {
+            fill(stamps.begin(), stamps.end(), 0);
+            epoch = 1;
+        }
+    }
+
+    int32_t get(AccountId account) const {
+        uint64_t stamp = stamps[account];
+        return (stamp >> 32) == epoch ? static_cast<int32_t>(stamp & UINT32_MAX) : NONE;
+    }
+
+    void set(AccountId account, int32_t index) {
+        stamps[account] = (static_cast<uint64_t>(epoch) << 32) | static_cast<uint32_t>(index);
+    }
+
+private:
+    vector<uint64_t> stamps; // epoch << 32 | batch index
+    uint32_t epoch = 0;
+};
+
+// Settle a batch of due transactions on several threads. Accounts are split
+// into shards by id and each shard's worker settles, in batch order, the
+// transactions whose sender it owns. A transaction can only be affected by
+// the earlier ones touching its sender or recipient, so when the latest of
+// those belongs to another shard the worker waits for it first. Every
+// account therefore sees its checks and updates in the sequential order.
+// settled[i] says whether transaction i went through.
+void settleSharded(SettlementBatch& batch, vector<char>& settled, size_t shard_count) {
+    const int32_t NONE = LastTouch::NONE;
+    static LastTouch last_touch;
+    size_t n = batch.size();
+    const vector<Transaction>& transactions = batch.transactions;
+    auto shardOf = [shard_count](AccountId account) { return account % shard_count; };
+
+    // the cross-shard transactions each one has to wait for
+    vector<int32_t> wait_sender(n, NONE), wait_recipient(n, NONE);
+    vector<vector<uint32_t>> shard_batches(shard_count);
+    last_touch.startBatch();
+    for (size_t i = 0; i < n; ++i) {
+        const Transaction& t = transactions[i];
+        size_t shard = shardOf(t.sender);
+        int32_t sender_dep = last_touch.get(t.sender);
+        int32_t recipient_dep = last_touch.get(t.recipient);
+        if (sender_dep != NONE && shardOf(transactions[sender_dep].sender) != shard) wait_sender[i] = sender_dep;
+        if (recipient_dep != NONE && shardOf(transactions[recipient_dep].sender) != shard) wait_recipient[i] = recipient_dep;
+        last_touch.set(t.sender, static_cast<int32_t>(i));
+        last_touch.set(t.recipient, static_cast<int32_t>(i));
+        shard_batches[shard].push_back(static_cast<uint32_t>(i));
+    }
+
+    vector<atomic<char>> done(n);
+    for (auto& flag : done) flag.store(0, memory_order_relaxed);
+    settled.assign(n, 0);
+    auto waitFor = [&done](int32_t dep) {
+        if (dep == NONE) return;
+        while (!done[dep].load(memory_order_acquire)) this_thread::yield();
+    };
+    auto worker = [&](size_t shard) {
+        for (uint32_t i : shard_batches[shard]) {
+            waitFor(wait_sender[i]);
+            waitFor(wait_recipient[i]);
+            settled[i] = settleTransaction(batch, i);
+            done[i].store(1, memory_order_release);
+        }
+    };
+
+    shard_pool.run(shard_count, worker);
+}
+
+// Record the outcome of a settled transaction, in execution order
+template <typename Diagnostics>
+void finishTransaction(Transaction& t, bool settled) {
+    if (!settled) {
+        if (journal.enabled()) journal.recordRejection(t.id);
+        if (stats.enabled) ++stats.insufficient_funds;
+        Diagnostics::insufficientFunds(t);
+        return; // Discard transaction
+    }
+
+    // Record transaction
+    t.executed = true;
+    engine_tables.recordExecuted(t);
+    if (ledger_changes.recording) ledger_changes.executed.push_back(t);
+    if (stats.enabled) ++stats.executed;
+    if (journal.enabled()) journal.recordExecution(t.id, t.fee);
+    Diagnostics::executed(t);
+}
+
+template <typename Diagnostics>
+void processTransactions() {
+    ScopedLatency timer(stats.enabled ? &stats.drain_latency : nullptr);
+    // Stop at transactions whose execution time is in the future (unless in query mode)
+    Timestamp until = query_mode ? Timestamp(UINT64_MAX) : current_timestamp;
+    static SettlementBatch batch;
+    static vector<char> settled;
+    batch.clear();
+    Transaction due;
+    while (transaction_queue.popDue(until, due)) batch.add(due);
+    batch.computeFees();
+    if (stats.enabled) stats.drain_size.add(batch.size());
+
+    const size_t MIN_TRANSACTIONS_PER_SHARD = 1024;
+    size_t shard_count = settlement_shards ? settlement_shards : max(1u, thread::hardware_concurrency());
+    shard_count = min(shard_count, batch.size() / MIN_TRANSACTIONS_PER_SHARD + 1);
+    if (shard_count == 1) {
+        for (size_t i = 0; i < batch.size(); ++i) {
+            finishTransaction<Diagnostics>(batch.transactions[i], settleTransaction(batch, i));
+        }
+        return;
+    }
+
+    settleSharded(batch, settled, shard_count);
+    for (size_t i = 0; i < batch.size(); ++i) finishTransaction<Diagnostics>(batch.transactions[i], settled[i]);
+}
+
+// Settle everything due, reporting through the sink selected on the command line
+void processTransactions() {
+    if (verbose) {
+        processTransactions<TextDiagnostics>();
+    } else if (event_log.enabled()) {
+        processTransactions<EventDiagnostics>();
+    } else {
+        processTransactions<QuietDiagnostics>();
+    }
+}
+// Commands the engine cannot apply. The batch program reports them and
+// stops on all but an invalid place command; the server answers each one
+// to its client and carries on.
+enum class CommandError { NONE, INVALID_PLACE, DECREASING_TIMESTAMP, EXEC_BEFORE_PLACE };
+
+const char* commandErrorMessage(CommandError error) {
+    switch (error) {
+        case CommandError::INVALID_PLACE: return "Invalid place command\n";
+        case CommandError::DECREASING_TIMESTAMP: return "Invalid decreasing timestamp in 'place' command.\n";
+        case CommandError::EXEC_BEFORE_PLACE:
+            return "You cannot have an execution date before the current timestamp.\n";
+        default: return "";
+    }
+}
+
+// What the batch program does with a command's error
+void reportCommandError(CommandError error) {
+    if (error == CommandError::NONE) return;
+    cerr << commandErrorMessage(error);
+    if (error != CommandError::INVALID_PLACE) exit(1);
+}
+
+// PLACE TRANSACTION
+template <typename Diagnostics>
+CommandError placeTransaction(const OperationCommand& op) {
+    // Arguments (parsed by parseOperation)
+    Timestamp timestamp = op.place_timestamp;
+    uint32_t amount = op.amount;
+    Timestamp exec_date = op.exec_timestamp;
+    char fee_type = op.fee_type;
+    string_view sender = op.user_id;
+    string_view recipient = op.recipient;
+
+    uint64_t place_time = timestamp.value;
+    uint64_t exec_time = exec_date.value;
+
+    // Error 1: Timestamp earlier than previous place command
+    if (place_time < last_place_timestamp.value) return CommandError::DECREASING_TIMESTAMP;
+
+    // Error 2: Execution date before current timestamp
+    if (exec_time < place_time) return CommandError::EXEC_BEFORE_PLACE;
+    current_timestamp = timestamp;
+
+    // 1. Check sender is different from recipient
+    if (sender == recipient) {
+        Diagnostics::placeRejected(EngineStats::SELF_TRANSACTION, op);
+        stats.reject(EngineStats::SELF_TRANSACTION);
+        return CommandError::NONE;
+    }
+
+    // 2. Check execution date is within 3 days
+    if (exec_time - place_time > 3000000) {
+        Diagnostics::placeRejected(EngineStats::EXEC_TOO_LATE, op);
+        stats.reject(EngineStats::EXEC_TOO_LATE);
+        return CommandError::NONE;
+    }
+
+    // 3. Check sender exists
+    AccountId sender_id = op.account;
+    if (sender_id == NO_ACCOUNT) {
+        Diagnostics::placeRejected(EngineStats::NO_SENDER, op);
+        stats.reject(EngineStats::NO_SENDER);
+        return CommandError::NONE;
+    }
+
+    // 4. Check recipient exists
+    AccountId recipient_id = op.recipient_account;
+    if (recipient_id == NO_ACCOUNT) {
+        Diagnostics::placeRejected(EngineStats::NO_RECIPIENT, op);
+        stats.reject(EngineStats::NO_RECIPIENT);
+        return CommandError::NONE;
+    }
+
+    // 5. Check registration dates are BEFORE OR EQUAL to execution time
+    uint64_t sender_reg = accounts.reg_timestamps[sender_id].value;
+    uint64_t recipient_reg = accounts.reg_timestamps[recipient_id].value;
+    if (exec_time < sender_reg || exec_time < recipient_reg) {
+        Diagnostics::placeRejected(EngineStats::NOT_REGISTERED, op);
+        stats.reject(EngineStats::NOT_REGISTERED);
+        return CommandError::NONE;
+    }
+
+    // 6. Check sender is logged in
+    if (!accounts.logged_in[sender_id]) {
+        Diagnostics::placeRejected(EngineStats::NOT_LOGGED_IN, op);
+        stats.reject(EngineStats::NOT_LOGGED_IN);
+        return CommandError::NONE;
+    }
+
+    // 7. Check fraudulent transaction
+    if (!accounts.sessions.contains(sender_id, op.ip)) {
+        Diagnostics::placeRejected(EngineStats::FRAUD, op);
+        stats.reject(EngineStats::FRAUD);
+        return CommandError::NONE;
+    }
+
+    // All checks passed — update last_place_timestamp
+    last_place_timestamp = timestamp;
+
+
+    // Process transactions that are due
+    processTransactions<Diagnostics>();
+
+    // Create and queue the new transaction
+    Transaction t(timestamp, exec_date, sender_id, recipient_id, amount, fee_type);
+    engine_tables.recordPlacement(timestamp);
+    if (ledger_changes.recording) ledger_changes.placements.push_back(timestamp);
+    transaction_queue.schedule(t);
+    if (stats.enabled) {
+        ++stats.placed;
+        stats.queue_depth.add(transaction_queue.size());
+    }
+    if (journal.enabled()) journal.recordPlacement(t);
+    Diagnostics::placed(t, op);
+    return CommandError::NONE;
+}
+
+// Apply one parsed operation command
+template <typename Diagnostics>
+CommandError executeOperation(const OperationCommand& op) {
+    switch (op.type) {
+        case OperationCommand::LOGIN: {
+            ScopedLatency timer(stats.latencyOf(EngineStats::LOGIN));
+            handleLogin<Diagnostics>(op.account, op.user_id, op.pin, op.ip);
+            break;
+        }
+        case OperationCommand::LOGOUT: {
+            ScopedLatency timer(stats.latencyOf(EngineStats::LOGOUT));
+            handleLogout<Diagnostics>(op.account, op.user_id, op.ip);
+            break;
+        }
+        case OperationCommand::BALANCE: {
+            ScopedLatency timer(stats.latencyOf(EngineStats::BALANCE));
+            handleBalance<Diagnostics>(op.account, op.user_id, op.ip);
+            break;
+        }
+        case OperationCommand::PLACE: {
+            ScopedLatency timer(stats.latencyOf(EngineStats::PLACE));
+            return placeTransaction<Diagnostics>(op);
+        }
+        case OperationCommand::BAD_PLACE: {
+            ScopedLatency timer(stats.latencyOf(EngineStats::PLACE));
+            return CommandError::INVALID_PLACE;
+        }
+        default:
+            break;
+    }
+    return CommandError::NONE;
+}
+
+// The sink is picked once per command, so each mode runs its own handlers
+CommandError executeOperation(const OperationCommand& op) {
+    if (verbose) return executeOperation<TextDiagnostics>(op);
+    if (event_log.enabled()) return executeOperation<EventDiagnostics>(op);
+    return executeOperation<QuietDiagnostics>(op);
+}
+
+// Apply one tokenized operation command (login, out, balance or place)
+CommandError runOperation(const Tokens& args) {
+    OperationCommand op;
+    parseOperation(args, op);
+    return executeOperation(op);
+}
+
+// ---TRANSACTION_FUNCTIONS---
+
+// ---QUERY_FUNCTIONS---
 
 // LIST TRANSACTIONS
-void listTransactions(const string& x, const string& y) {
+void listTransactions(OutputBuffer& out, const LedgerView& ledger, Timestamp x, Timestamp y) {
+    if (x == y) {
+        out << "List Transactions requires a non-empty time interval.\n";
+        return;
+    }
+    
+    if (y < x) {
+        out << "List Transactions requires a non-empty time interval.\n";
+        return;
+    }
+    
+    // History is already in (exec time, id) order, so the range is contiguous
+    auto first = historyLowerBound(ledger.history, x);
+    auto last = historyLowerBound(ledger.history, y);
+    size_t count = static_cast<size_t>(last - first);
+    
+    // Print results
+    for (auto it = first; it != last; ++it) {
+        writeTransactionRow(out, *it);
+    }
+    
+    out << "There " << (count == 1 ? "was " : "were ") << count
+         << " transaction" << (count == 1 ? "" : "s") 
+         << " that " << (count == 1 ? "was " : "were ") << "executed between time " << x << " to " << y << ".\n";
+}
+
+// CALCULATE REVENUE
+void calculateRevenue(OutputBuffer& out, const LedgerView& ledger, Timestamp x, Timestamp y) {
     if (x == y) {
-        cout << "List Transactions requires a non-empty time interval.\n";
+        out << "Bank Revenue requires a non-empty time interval.\n";
+        return;
+    }
+    
+    if (y < x) {
+        out << "Bank Revenue requires a non-empty time interval.\n";
         return;
     }
     
-    uint64_t x_sec = stoull(removeColonsAndLeadingZeros(x));
-    uint64_t y_sec = stoull(removeColonsAndLeadingZeros(y));
+    uint64_t total_fees = ledger.fees.feesPlacedBetween(x, y);
     
-    if (y_sec < x_sec) {
-        cout << "List Transactions requires a non-empty time interval.\n";
+    out << "281Bank has collected " << total_fees << " dollars in fees over ";
+    writeTimeInterval(out, x.value, y.value);
+    out << ".\n";
+}
+
+// CUSTOMER HISTORY
+void customerHistory(OutputBuffer& out, const LedgerView& ledger, string_view user_id) {
+    AccountId id = accounts.find(user_id);
+    if (id == NO_ACCOUNT) {
+        out << "User " << user_id << " does not exist.\n";
         return;
     }
     
-    vector<Transaction> results;
-    for (const auto& t : transaction_history) {
-        uint64_t exec_sec = stoull(removeColonsAndLeadingZeros(t.exec_timestamp));
-        if (exec_sec >= x_sec && exec_sec < y_sec) {
-            results.push_back(t);
-        }
-    }
+    const RecentHistory& incoming = ledger.incoming[id];
+    const RecentHistory& outgoing = ledger.outgoing[id];
+    out << "Customer " << user_id << " account summary:\n";
+    out << "Balance: $" << ledger.balances[id] << "\n";
     
-    // Sort by execution time then ID
-    sort(results.begin(), results.end(), [](const Transaction& a, const Transaction& b) {
-        if (a.exec_timestamp != b.exec_timestamp) {
-            return stoull(removeColonsAndLeadingZeros(a.exec_timestamp)) < stoull(removeColonsAndLeadingZeros(b.exec_timestamp));
-        }
-        return a.id < b.id;
-    });
+    size_t total_trans = incoming.size() + outgoing.size();
+    out << "Total # of transactions: " << total_trans << "\n";
     
-    // Print results
-    for (const auto& t : results) {
-        cout << t.id << ": " << t.sender << " sent " << t.amount 
-             << " dollar" << (t.amount != 1 ? "s" : "") << " to " << t.recipient 
-             << " at " << removeColonsAndLeadingZeros(t.exec_timestamp) << ".\n";
-    }
+    // Incoming transactions (the last 10)
+    out << "Incoming " << incoming.size() << ":" << "\n";
+    incoming.forEachLatest([&](uint32_t index) { writeTransactionRow(out, ledger.history[index]); });
     
-    cout << "There " << (results.size() == 1 ? "was " : "were ") << results.size()
-         << " transaction" << (results.size() == 1 ? "" : "s") 
-         << " that " << (results.size() == 1 ? "was " : "were ") << "executed between time " << removeColonsAndLeadingZeros(x) << " to " << removeColonsAndLeadingZeros(y) << ".\n";
+    // Outgoing transactions (the last 10)
+    out << "Outgoing " << outgoing.size() << ":" << "\n";
+    outgoing.forEachLatest([&](uint32_t index) { writeTransactionRow(out, ledger.history[index]); });
 }
 
-// CALCULATE REVENUE
-void calculateRevenue(const string& x, const string& y) {
-    if (x == y) {
-        cout << "Bank Revenue requires a non-empty time interval.\n";
-        return;
-    }
+void summarizeDay(OutputBuffer& out, const LedgerView& ledger, Timestamp timestamp) {
+    // Extract day part (yymmdd)
+    uint64_t day_part = timestamp.value / 1000000;
     
-    uint64_t x_sec = stoull(removeColonsAndLeadingZeros(x));
-    uint64_t y_sec = stoull(removeColonsAndLeadingZeros(y));
+    // Increment day; each component is 00-99, so carrying is plain addition
+    // and only the year wraps back to 00
+    uint64_t next_day = (day_part + 1) % 1000000;
     
-    if (y_sec < x_sec) {
-        cout << "Bank Revenue requires a non-empty time interval.\n";
-        return;
+    Timestamp start_time(day_part * 1000000);
+    Timestamp end_time(next_day * 1000000);
+    
+    out << "Summary of [" << start_time << ", " << end_time << "):\n";
+    
+    // The day's rollup gives its run of the history and its fee total (the
+    // interval is empty when the year wraps and end_time < start_time)
+    const DayRollups::Day* rollup = end_time < start_time ? nullptr : ledger.days.find(day_part);
+    size_t count = rollup ? rollup->count : 0;
+    unsigned int total_fees = rollup ? static_cast<unsigned int>(rollup->fees) : 0;
+    
+    for (size_t i = 0; i < count; ++i) {
+        writeTransactionRow(out, ledger.history[rollup->first + i]);
     }
     
-    unsigned int total_fees = 0;
-    for (const auto& t : transaction_history) {
-        uint64_t place_sec = stoull(removeColonsAndLeadingZeros(t.place_timestamp));
-        if (place_sec >= x_sec && place_sec < y_sec) {
-            total_fees += t.fee;
+    out << "There " << (count == 1 ? "was " : "were ") << "a total of " << count
+         << " transaction" << (count == 1 ? "" : "s") << ", "
+         << "281Bank has collected " << total_fees << " dollars in fees.\n";
+}
+// ---QUERY_FUNCTIONS---
+
+// ---QUERY_ENGINE---
+
+// One parsed query command from after "$$$"
+struct QueryCommand {
+    char type = 0; // 'l', 'r', 'h' or 's'
+    Timestamp x;
+    Timestamp y;
+    string user_id;
+};
+
+void runQuery(OutputBuffer& out, const QueryCommand& query, const LedgerView& ledger = engine_ledger) {
+    Histogram* latency = nullptr;
+    if (stats.enabled) {
+        switch (query.type) {
+            case 'l': latency = &stats.latency[EngineStats::QUERY_L]; break;
+            case 'r': latency = &stats.latency[EngineStats::QUERY_R]; break;
+            case 'h': latency = &stats.latency[EngineStats::QUERY_H]; break;
+            case 's': latency = &stats.latency[EngineStats::QUERY_S]; break;
+            default: break;
         }
     }
+    ScopedLatency timer(latency);
+    switch (query.type) {
+        case 'l':
+            listTransactions(out, ledger, query.x, query.y);
+            break;
+        case 'r':
+            calculateRevenue(out, ledger, query.x, query.y);
+            break;
+        case 'h':
+            customerHistory(out, ledger, query.user_id);
+            break;
+        case 's':
+            summarizeDay(out, ledger, query.x);
+            break;
+        default:
+            break;
+    }
+}
+
+// false for anything that is not one of the four query commands
+bool parseQuery(const Tokens& args, QueryCommand& query) {
+    string_view command = args[0];
+    if (command.size() != 1) return false;
     
-    uint64_t xnum = stoull(removeColonsAndLeadingZeros(x));
-    uint64_t ynum = stoull(removeColonsAndLeadingZeros(y));
-    // uint64_t interval = y_sec - x_sec;
-    cout << "281Bank has collected " << total_fees 
-         << " dollars in fees over " << formatTimeInterval(xnum, ynum) << ".\n";
+    query.type = command[0];
+    switch (query.type) {
+        case 'l':
+        case 'r':
+            query.x = Timestamp::parse(args[1]);
+            query.y = Timestamp::parse(args[2]);
+            return true;
+        case 'h':
+            query.user_id = string(args[1]);
+            return true;
+        case 's':
+            query.x = Timestamp::parse(args[1]);
+            return true;
+        default:
+            return false;
+    }
 }
 
-// CUSTOMER HISTORY
-void customerHistory(const string& user_id) {
-    auto it = users.find(user_id);
-    if (it == users.end()) {
-        cout << "User " << user_id << " does not exist.\n";
+// Read the rest of the input as queries, stopping at a blank command line
+// the way the query loop always has
+vector<QueryCommand> readQueryBatch(CommandReader& reader) {
+    vector<QueryCommand> batch;
+    string_view line;
+    Tokens args;
+    while (reader.nextLine(line)) {
+        if (line.empty() || line == "$$$" || line[0] == '#') continue;
+        
+        tokenize(line, args);
+        if (args[0].empty()) break;
+        
+        QueryCommand query;
+        if (parseQuery(args, query)) batch.push_back(move(query));
+    }
+    return batch;
+}
+
+// Run every remaining query. Once "$$$" has drained the queue, the history,
+// fee index and accounts are frozen, so queries are evaluated in parallel
+// into their own buffers and written out in input order, block by block.
+void runQueryBatch(const vector<QueryCommand>& batch) {
+    const size_t MIN_QUERIES_PER_THREAD = 64;
+    size_t thread_count = min<size_t>(max(1u, thread::hardware_concurrency()),
+                                      batch.size() / MIN_QUERIES_PER_THREAD + 1);
+    if (thread_count == 1) {
+        for (const QueryCommand& query : batch) runQuery(output, query);
         return;
     }
     
-    const User& user = it->second;
-    cout << "Customer " << user_id << " account summary:\n";
-    cout << "Balance: $" << user.balance << "\n";
-    
-    size_t total_trans = user.incoming.size() + user.outgoing.size();
-    cout << "Total # of transactions: " << total_trans << "\n";
-    
-    // Incoming transactions
-    cout << "Incoming " << user.incoming.size() << ":" << "\n";
-    size_t start_in = (user.incoming.size() > 10) ? user.incoming.size() - 10 : 0;
-    for (size_t i = start_in; i < user.incoming.size(); ++i) {
-        const auto& t = user.incoming[i];
-        cout << t.id << ": " << t.sender << " sent " << t.amount 
-             << " dollar" << (t.amount != 1 ? "s" : "") << " to " << t.recipient 
-             << " at " << removeColonsAndLeadingZeros(t.exec_timestamp) << ".\n";
-    }
-    
-    // Outgoing transactions
-    cout << "Outgoing " << user.outgoing.size() << ":" << "\n";
-    size_t start_out = (user.outgoing.size() > 10) ? user.outgoing.size() - 10 : 0;
-    for (size_t i = start_out; i < user.outgoing.size(); ++i) {
-        const auto& t = user.outgoing[i];
-        cout << t.id << ": " << t.sender << " sent " << t.amount 
-             << " dollar" << (t.amount != 1 ? "s" : "") << " to " << t.recipient 
-             << " at " << removeColonsAndLeadingZeros(t.exec_timestamp) << ".\n";
-    }
-}
-
-void summarizeDay(const string& timestamp) {
-    // Extract day part (yy:mm:dd)
-    string day_part = timestamp.substr(0, 8); // "yy:mm:dd"
-    string next_day = day_part;
-    
-    // Increment day (properly handling all components)
-    int year = stoi(next_day.substr(0, 2));
-    int month = stoi(next_day.substr(3, 2));
-    int day = stoi(next_day.substr(6, 2));
-    
-    day++;
-    // Handle component overflow (all components can be 00-99)
-    if (day > 99) {
-        day = 0;
-        month++;
-        if (month > 99) {
-            month = 0;
-            year++;
-            if (year > 99) {
-                year = 0;
+    const size_t BLOCK_SIZE = thread_count * 256;
+    for (size_t block_start = 0; block_start < batch.size(); block_start += BLOCK_SIZE) {
+        size_t block_size = min(BLOCK_SIZE, batch.size() - block_start);
+        vector<OutputBuffer> results(block_size);
+        atomic<size_t> next(0);
+        auto worker = [&]() {
+            for (size_t i = next++; i < block_size; i = next++) {
+                runQuery(results[i], batch[block_start + i]);
+            }
+        };
+        
+        vector<thread> workers;
+        for (size_t i = 1; i < thread_count; ++i) workers.emplace_back(worker);
+        worker();
+        for (auto& t : workers) t.join();
+        
+        for (const OutputBuffer& result : results) output << result.contents();
+    }
+}
+
+
+// Live queries (--live-queries): l/r/h/s lines between operations are
+// answered as of their place in the input, without holding up ingest. A
+// reader thread keeps its own replica of the ledger. The engine only
+// records what it placed and executed (LedgerChanges), and at each query
+// hands that over in one batch along with the output produced so far. The
+// reader applies the batch, so its replica is exactly the engine's state at
+// the query, then writes the output and the answer. Engine output stays in
+// memory while this runs so everything reaches stdout in input order.
+class LiveQueries {
+public:
+    bool active() const { return reader.joinable(); }
+
+    // copy the ledger as it stands after loading, then start the reader
+    void start() {
+        replica.history = transaction_history;
+        replica.fees = fee_index;
+        replica.days = day_rollups;
+        replica.incoming = accounts.incoming;
+        replica.outgoing = accounts.outgoing;
+        replica.balances = accounts.balances;
+        ledger_changes.recording = true;
+        output.redirect(-1);
+        reader = thread([this]() { readerLoop(); });
+    }
+
+    void query(const QueryCommand& query) {
+        Batch batch = takeChanges();
+        batch.has_query = true;
+        batch.query = query;
+        post(move(batch));
+    }
+
+    // hand over the output so far once it builds up
+    void flushOutput() {
+        if (output.contents().size() >= OUTPUT_HANDOFF) post(takeChanges());
+    }
+
+    // hand over everything left, wait for the reader, and write directly again
+    void finish() {
+        if (!active()) return;
+        post(takeChanges());
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            done = true;
+        }
+        queue_ready.notify_one();
+        reader.join();
+        ledger_changes.recording = false;
+        output.redirect(STDOUT_FILENO);
+    }
+
+private:
+    static const size_t OUTPUT_HANDOFF = 1 << 20;
+
+    struct Batch {
+        vector<Timestamp> placements;
+        vector<Transaction> executed;
+        string text; // engine output before the query
+        bool has_query = false;
+        QueryCommand query;
+    };
+
+    struct Replica {
+        vector<Transaction> history;
+        FeeIndex fees;
+        DayRollups days;
+        vector<RecentHistory> incoming;
+        vector<RecentHistory> outgoing;
+        vector<uint32_t> balances;
+
+        LedgerView view() const { return {history, fees, days, incoming, outgoing, balances}; }
+
+        // the updates the engine made, through the same LedgerTables
+        void apply(const Batch& batch) {
+            LedgerTables tables = {history, fees, days, incoming, outgoing, balances};
+            for (Timestamp place_time : batch.placements) tables.recordPlacement(place_time);
+            for (const Transaction& t : batch.executed) tables.applyExecuted(t);
+        }
+    };
+
+    Batch takeChanges() {
+        Batch batch;
+        batch.placements.swap(ledger_changes.placements);
+        batch.executed.swap(ledger_changes.executed);
+        batch.text = string(output.contents());
+        output.clear();
+        return batch;
+    }
+
+    void post(Batch batch) {
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            batches.push_back(move(batch));
+        }
+        queue_ready.notify_one();
+    }
+
+    void readerLoop() {
+        OutputBuffer out(STDOUT_FILENO);
+        while (true) {
+            Batch batch;
+            {
+                unique_lock<mutex> lock(queue_mutex);
+                queue_ready.wait(lock, [this]() { return done || !batches.empty(); });
+                if (batches.empty()) return;
+                batch = move(batches.front());
+                batches.pop_front();
             }
+            replica.apply(batch);
+            out << batch.text;
+            if (batch.has_query) runQuery(out, batch.query, replica.view());
         }
     }
+
+    Replica replica;
+    thread reader;
+    mutex queue_mutex;
+    condition_variable queue_ready;
+    deque<Batch> batches;
+    bool done = false;
+};
+LiveQueries live_queries;
+
+// ---QUERY_ENGINE---
+
+// ---SNAPSHOT---
+
+// Binary snapshot of the whole engine: a fixed header, then arrays of
+// fixed-size records, then one string table that the records point into.
+// Everything is native-endian and 8-byte aligned so a mapped file can be read
+// in place. Per-user histories and the fee tree are not stored; they are
+// rebuilt from the history and placement times on restore.
+const char SNAPSHOT_MAGIC[8] = {'B', 'A', 'N', 'K', 'S', 'N', 'A', 'P'};
+const uint32_t SNAPSHOT_VERSION = 1;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t transaction_counter;
+    uint64_t current_timestamp;
+    uint64_t last_place_timestamp;
+    uint64_t account_count;
+    uint64_t session_count;
+    uint64_t pending_count;
+    uint64_t history_count;
+    uint64_t placement_count;
+    uint64_t string_bytes;
+};
+static_assert(sizeof(SnapshotHeader) == 80, "SnapshotHeader is 80 bytes on disk");
+
+// offset/length of a string in the string table
+struct SnapshotString {
+    uint32_t offset;
+    uint32_t length;
+};
+static_assert(sizeof(SnapshotString) == 8, "SnapshotString is 8 bytes on disk");
+
+struct SnapshotAccount {
+    SnapshotString user_id;
+    SnapshotString pin;
+    uint64_t reg_timestamp;
+    uint32_t balance;
+    uint32_t logged_in;
+    uint32_t session_begin; // index of the first of this account's sessions
+    uint32_t session_count;
+};
+static_assert(sizeof(SnapshotAccount) == 40, "SnapshotAccount is 40 bytes on disk");
+
+struct SnapshotTransaction {
+    uint64_t place_timestamp;
+    uint64_t exec_timestamp;
+    int32_t id;
+    uint32_t sender;
+    uint32_t recipient;
+    uint32_t amount;
+    uint32_t fee;
+    char fee_type;
+    char executed;
+    char padding[2];
+};
+static_assert(sizeof(SnapshotTransaction) == 40, "SnapshotTransaction is 40 bytes on disk");
+
+SnapshotTransaction toSnapshot(const Transaction& t) {
+    SnapshotTransaction record = {};
+    record.place_timestamp = t.place_timestamp.value;
+    record.exec_timestamp = t.exec_timestamp.value;
+    record.id = t.id;
+    record.sender = t.sender;
+    record.recipient = t.recipient;
+    record.amount = t.amount;
+    record.fee = t.fee;
+    record.fee_type = t.fee_type;
+    record.executed = t.executed;
+    return record;
+}
+
+Transaction fromSnapshot(const SnapshotTransaction& record) {
+    Transaction t;
+    t.place_timestamp = Timestamp(record.place_timestamp);
+    t.exec_timestamp = Timestamp(record.exec_timestamp);
+    t.id = record.id;
+    t.sender = record.sender;
+    t.recipient = record.recipient;
+    t.amount = record.amount;
+    t.fee = record.fee;
+    t.fee_type = record.fee_type;
+    t.executed = record.executed != 0;
+    return t;
+}
+
+template <typename T>
+void appendBytes(string& out, const T* items, size_t count) {
+    out.append(reinterpret_cast<const char*>(items), count * sizeof(T));
+}
+
+// SAVE SNAPSHOT
+void saveSnapshot(const string& filename) {
+    string strings;
+    auto intern = [&strings](string_view text) {
+        SnapshotString ref = {static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(text.size())};
+        strings.append(text);
+        return ref;
+    };
+    
+    vector<SnapshotAccount> account_records;
+    vector<SnapshotString> session_records;
+    account_records.reserve(accounts.user_ids.size());
+    for (AccountId id = 0; id < accounts.user_ids.size(); ++id) {
+        SnapshotAccount record = {};
+        record.user_id = intern(accounts.user_ids[id]);
+        record.pin = intern(accounts.pins[id]);
+        record.reg_timestamp = accounts.reg_timestamps[id].value;
+        record.balance = accounts.balances[id];
+        record.logged_in = accounts.logged_in[id];
+        record.session_begin = static_cast<uint32_t>(session_records.size());
+        accounts.sessions.forEach(id, [&](IpAddress ip) { session_records.push_back(intern(ip.text())); });
+        record.session_count = static_cast<uint32_t>(session_records.size()) - record.session_begin;
+        account_records.push_back(record);
+    }
+    
+    // pending transactions go out in id order, the order they are rescheduled in
+    vector<SnapshotTransaction> pending_records;
+    transaction_queue.forEach([&pending_records](const Transaction& t) {
+        pending_records.push_back(toSnapshot(t));
+    });
+    sort(pending_records.begin(), pending_records.end(),
+         [](const SnapshotTransaction& a, const SnapshotTransaction& b) { return a.id < b.id; });
     
-    // Format next_day with leading zeros
-    next_day = 
-        (year < 10 ? "0" : "") + to_string(year) + ":" +
-        (month < 10 ? "0" : "") + to_string(month) + ":" +
-        (day < 10 ? "0" : "") + to_string(day);
+    vector<SnapshotTransaction> history_records;
+    history_records.reserve(transaction_history.size());
+    for (const Transaction& t : transaction_history) history_records.push_back(toSnapshot(t));
     
-    string start_time = day_part + "00:00:00";
-    string end_time = next_day + "00:00:00";
+    SnapshotHeader header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.transaction_counter = transaction_counter;
+    header.current_timestamp = current_timestamp.value;
+    header.last_place_timestamp = last_place_timestamp.value;
+    header.account_count = account_records.size();
+    header.session_count = session_records.size();
+    header.pending_count = pending_records.size();
+    header.history_count = history_records.size();
+    header.placement_count = fee_index.place_times.size();
+    header.string_bytes = strings.size();
     
-    vector<Transaction> results;
-    unsigned int total_fees = 0;
+    string bytes;
+    appendBytes(bytes, &header, 1);
+    appendBytes(bytes, account_records.data(), account_records.size());
+    appendBytes(bytes, session_records.data(), session_records.size());
+    appendBytes(bytes, pending_records.data(), pending_records.size());
+    appendBytes(bytes, history_records.data(), history_records.size());
+    appendBytes(bytes, fee_index.place_times.data(), fee_index.place_times.size());
+    bytes.append(strings);
     
-    for (const auto& t : transaction_history) {
-        if (t.exec_timestamp >= start_time && t.exec_timestamp < end_time) {
-            results.push_back(t);
-            total_fees += t.fee;
-        }
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || !writeAll(fd, bytes.data(), bytes.size()) || (journal.enabled() && fdatasync(fd) != 0)) {
+        cerr << "Error: Could not write snapshot file " << filename << "\n";
+        exit(1);
+    }
+    close(fd);
+    // the snapshot holds everything journaled so far
+    if (journal.enabled()) journal.rotate(accounts.user_ids.size(), stateFingerprint());
+}
+
+// view count records of type T at cursor and step past them
+template <typename T>
+const T* takeSection(const char*& cursor, uint64_t count) {
+    const T* items = reinterpret_cast<const T*>(cursor);
+    cursor += count * sizeof(T);
+    return items;
+}
+
+// RESTORE SNAPSHOT
+void restoreSnapshot(const string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    MappedFile file;
+    if (fd < 0 || !file.map(fd)) {
+        cerr << "Error: Could not open snapshot file " << filename << "\n";
+        exit(1);
+    }
+    close(fd);
+    
+    const char* data = file.data();
+    SnapshotHeader header;
+    if (file.size() < sizeof(header)) {
+        cerr << "Error: Snapshot file " << filename << " is truncated\n";
+        exit(1);
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_VERSION) {
+        cerr << "Error: " << filename << " is not a version " << SNAPSHOT_VERSION << " snapshot\n";
+        exit(1);
     }
+    auto corrupt = [&filename](const char* problem) {
+        cerr << "Error: Snapshot file " << filename << " is " << problem << "\n";
+        exit(1);
+    };
+    // each count is bounded by the file size first so the sum cannot overflow
+    uint64_t size = file.size();
+    if (header.account_count > size || header.session_count > size || header.pending_count > size ||
+        header.history_count > size || header.placement_count > size || header.string_bytes > size) {
+        corrupt("truncated");
+    }
+    uint64_t expected = sizeof(header) + header.account_count * sizeof(SnapshotAccount)
+        + header.session_count * sizeof(SnapshotString)
+        + (header.pending_count + header.history_count) * sizeof(SnapshotTransaction)
+        + header.placement_count * sizeof(Timestamp) + header.string_bytes;
+    if (size != expected) corrupt("truncated");
     
-    // Format timestamps for output - just remove colons from the full timestamps
-    string formatted_start = removeColonsAndLeadingZeros(start_time);
-    string formatted_end = removeColonsAndLeadingZeros(end_time);
+    const char* cursor = data + sizeof(header);
+    const SnapshotAccount* account_records = takeSection<SnapshotAccount>(cursor, header.account_count);
+    const SnapshotString* session_records = takeSection<SnapshotString>(cursor, header.session_count);
+    const SnapshotTransaction* pending_records = takeSection<SnapshotTransaction>(cursor, header.pending_count);
+    const SnapshotTransaction* history_records = takeSection<SnapshotTransaction>(cursor, header.history_count);
+    const Timestamp* place_times = takeSection<Timestamp>(cursor, header.placement_count);
+    const char* strings = cursor;
+    auto text = [strings](SnapshotString ref) { return string_view(strings + ref.offset, ref.length); };
     
-    cout << "Summary of [" << formatted_start << ", " << formatted_end << "):\n";
+    // Check every reference before touching engine state
+    auto validString = [&header](SnapshotString ref) {
+        return static_cast<uint64_t>(ref.offset) + ref.length <= header.string_bytes;
+    };
+    auto validTransaction = [&header](const SnapshotTransaction& record) {
+        return record.id >= 0 && record.id < header.transaction_counter &&
+               record.sender < header.account_count && record.recipient < header.account_count;
+    };
+    // a repeated user id would merge into one account and leave the table
+    // shorter than the ids the transactions refer to
+    unordered_set<string_view> user_ids;
+    user_ids.reserve(header.account_count);
+    for (uint64_t i = 0; i < header.account_count; ++i) {
+        const SnapshotAccount& record = account_records[i];
+        if (!validString(record.user_id) || !validString(record.pin) ||
+            static_cast<uint64_t>(record.session_begin) + record.session_count > header.session_count) {
+            corrupt("corrupt (bad account record)");
+        }
+        if (!user_ids.insert(text(record.user_id)).second) corrupt("corrupt (duplicate user id)");
+    }
+    // every placed transaction took one id and recorded one place time, in
+    // the non-decreasing order place commands are held to
+    if (header.transaction_counter < 0 ||
+        header.placement_count != static_cast<uint64_t>(header.transaction_counter)) {
+        corrupt("corrupt (placement count does not match the transaction counter)");
+    }
+    for (uint64_t i = 1; i < header.placement_count; ++i) {
+        if (place_times[i] < place_times[i - 1]) corrupt("corrupt (place times out of order)");
+    }
+    for (uint64_t i = 0; i < header.session_count; ++i) {
+        if (!validString(session_records[i])) corrupt("corrupt (bad session record)");
+    }
+    for (uint64_t i = 0; i < header.history_count; ++i) {
+        const SnapshotTransaction& record = history_records[i];
+        if (!validTransaction(record)) corrupt("corrupt (bad history record)");
+        // the history has to stay in (exec time, id) order for the queries
+        if (i > 0) {
+            const SnapshotTransaction& previous = history_records[i - 1];
+            if (record.exec_timestamp < previous.exec_timestamp ||
+                (record.exec_timestamp == previous.exec_timestamp && record.id <= previous.id)) {
+                corrupt("corrupt (history out of order)");
+            }
+        }
+    }
+    for (uint64_t i = 0; i < header.pending_count; ++i) {
+        const SnapshotTransaction& record = pending_records[i];
+        if (!validTransaction(record) || (i > 0 && record.id <= pending_records[i - 1].id)) {
+            corrupt("corrupt (bad pending record)");
+        }
+    }
     
-    // Sort by execution time then ID
-    sort(results.begin(), results.end(), [](const Transaction& a, const Transaction& b) {
-        if (a.exec_timestamp != b.exec_timestamp) {
-            return stoull(removeColonsAndLeadingZeros(a.exec_timestamp)) < stoull(removeColonsAndLeadingZeros(b.exec_timestamp));
+    accounts.reserve(header.account_count);
+    for (uint64_t i = 0; i < header.account_count; ++i) {
+        const SnapshotAccount& record = account_records[i];
+        AccountId id = accounts.add(text(record.user_id), text(record.pin), record.balance,
+                                    Timestamp(record.reg_timestamp));
+        accounts.logged_in[id] = static_cast<char>(record.logged_in != 0);
+        for (uint32_t j = 0; j < record.session_count; ++j) {
+            accounts.sessions.insert(id, IpAddress::parse(text(session_records[record.session_begin + j])));
         }
-        return a.id < b.id;
-    });
+    }
     
-    for (const auto& t : results) {
-        cout << t.id << ": " << t.sender << " sent " << t.amount 
-             << " dollar" << (t.amount != 1 ? "s" : "") << " to " << t.recipient 
-             << " at " << removeColonsAndLeadingZeros(t.exec_timestamp) << ".\n";
+    for (uint64_t i = 0; i < header.placement_count; ++i) engine_tables.recordPlacement(place_times[i]);
+    
+    transaction_history.reserve(header.history_count);
+    for (uint64_t i = 0; i < header.history_count; ++i) {
+        engine_tables.recordExecuted(fromSnapshot(history_records[i]));
     }
     
-    cout << "There " << (results.size() == 1 ? "was " : "were ") << "a total of " << results.size()
-         << " transaction" << (results.size() == 1 ? "" : "s") << ", "
-         << "281Bank has collected " << total_fees << " dollars in fees.\n";
+    for (uint64_t i = 0; i < header.pending_count; ++i) {
+        transaction_queue.schedule(fromSnapshot(pending_records[i]));
+    }
+    
+    transaction_counter = header.transaction_counter;
+    current_timestamp = Timestamp(header.current_timestamp);
+    last_place_timestamp = Timestamp(header.last_place_timestamp);
 }
-// ---QUERY_FUNCTIONS---
 
+// ---SNAPSHOT---
+
+
+// ---SERVER---
+
+// Server mode (--listen / --tcp-port): the engine is loaded once and local
+// clients connect to it, each speaking the stdin protocol: operations, then
+// optionally "$$$" and queries. A single epoll loop applies lines in the
+// order they arrive, so operations from every client share one global
+// order, and each client gets back only the output of its own lines.
+// "$$$" just switches that client to queries; nothing is drained, so its
+// queries see what has executed so far. A place command that would stop the
+// batch program (bad token count, decreasing timestamp, exec before place)
+// is answered with the message and skipped instead. SIGINT or SIGTERM ends
+// the loop.
+struct Connection {
+    int fd = -1;
+    string input;   // unfinished line
+    string replies; // output not yet sent
+    size_t sent = 0;
+    bool queries = false; // after "$$$"
+    bool closing = false; // the client has finished sending
+};
 
-// ------MAIN------
-int main(int argc, char* argv[]) {
+int listenUnix(const string& path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        cerr << "Error: socket path " << path << " is too long\n";
+        exit(1);
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(path.c_str());
+    if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        cerr << "Error: Could not listen on " << path << "\n";
+        exit(1);
+    }
+    return fd;
+}
 
-    getOptions(argc, argv);
-    // *received registration file in getOptions
-    loadRegistrationFile(registration_filename);
+int listenTcp(uint16_t port) {
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
     
-    string line;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int reuse = 1;
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+        bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        cerr << "Error: Could not listen on localhost port " << port << "\n";
+        exit(1);
+    }
+    return fd;
+}
+
+// Apply one line from a client; its output collects in the (in-memory) output
+void serveLine(Connection& connection, string_view line) {
+    if (line.empty()) return;
+    if (line == "$$$") {
+        connection.queries = true;
+        return;
+    }
+    if (line[0] == '#') return;
     
-    while (getline(cin, line)) {
-        if (line.empty()) continue;
-        
-        if (line == "$$$") {
-            query_mode = true;
-            // Process any remaining transactions
-            while (!transaction_queue.empty()) {
-                processTransactions();
-            }
+    Tokens args;
+    tokenize(line, args);
+    if (connection.queries) {
+        QueryCommand query;
+        if (parseQuery(args, query)) runQuery(output, query);
+        return;
+    }
+    output << commandErrorMessage(runOperation(args));
+}
+
+// Read what the client sent and apply every complete line, collecting the
+// output as its replies
+void serveInput(Connection& connection) {
+    char chunk[1 << 16];
+    while (true) {
+        ssize_t received = read(connection.fd, chunk, sizeof(chunk));
+        if (received > 0) {
+            connection.input.append(chunk, static_cast<size_t>(received));
             continue;
         }
+        if (received < 0 && errno == EINTR) continue;
+        if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) connection.closing = true;
+        break;
+    }
+    
+    size_t start = 0;
+    while (true) {
+        size_t newline = connection.input.find('\n', start);
+        if (newline == string::npos) break;
+        serveLine(connection, string_view(connection.input).substr(start, newline - start));
+        start = newline + 1;
+    }
+    connection.input.erase(0, start);
+    // like stdin, a last line without a newline still counts
+    if (connection.closing && !connection.input.empty()) {
+        serveLine(connection, connection.input);
+        connection.input.clear();
+    }
+    
+    connection.replies.append(output.contents());
+    output.clear();
+}
+
+// Send as much of the pending output as the socket takes; false on error
+bool sendReplies(Connection& connection) {
+    while (connection.sent < connection.replies.size()) {
+        ssize_t written = send(connection.fd, connection.replies.data() + connection.sent,
+                               connection.replies.size() - connection.sent, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        connection.sent += static_cast<size_t>(written);
+    }
+    connection.replies.clear();
+    connection.sent = 0;
+    return true;
+}
+
+void runServer() {
+    // shut down cleanly on SIGINT/SIGTERM, read through the event loop
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &stop_signals, nullptr);
+    int signal_fd = signalfd(-1, &stop_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (signal_fd < 0 || epoll_fd < 0) {
+        cerr << "Error: Could not start the event loop\n";
+        exit(1);
+    }
+    auto watch = [epoll_fd](int fd, uint32_t events, int operation) {
+        epoll_event event = {};
+        event.events = events;
+        event.data.fd = fd;
+        epoll_ctl(epoll_fd, operation, fd, &event);
+    };
+    
+    vector<int> listeners;
+    if (!listen_path.empty()) listeners.push_back(listenUnix(listen_path));
+    if (tcp_port != 0) listeners.push_back(listenTcp(tcp_port));
+    for (int fd : listeners) watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+    watch(signal_fd, EPOLLIN, EPOLL_CTL_ADD);
+    
+    // every client's output goes to its own reply stream
+    output.redirect(-1);
+    
+    unordered_map<int, Connection> connections;
+    auto disconnect = [&](int fd) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        ::close(fd);
+        connections.erase(fd);
+    };
+    
+    const int MAX_EVENTS = 64;
+    epoll_event events[MAX_EVENTS];
+    vector<int> ready;
+    bool running = true;
+    while (running) {
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            cerr << "Error: epoll_wait failed\n";
+            exit(1);
+        }
         
-        if (line[0] == '#') continue; // Skip comments
-        
-        istringstream iss(line);
-        string command;
-        iss >> command;
-        
-        if (!query_mode) {
-            // Operation commands
-            if (command == "login") {
-                string user_id, pin, ip;
-                iss >> user_id >> pin >> ip;
-                handleLogin(user_id, pin, ip);
-            }
-            else if (command == "out") {
-                string user_id, ip;
-                iss >> user_id >> ip;
-                handleLogout(user_id, ip);
-            }
-            else if (command == "balance") {
-                string user_id, ip;
-                iss >> user_id >> ip;
-                handleBalance(user_id, ip);
-            }
-            else if (command == "place") {
-                vector<string> args;
-                string arg;
-                while (iss >> arg) {
-                    args.push_back(arg);
-                }
-                if (args.size() != 7) {
-                    cerr << "Invalid place command\n";
-                    continue;
+        ready.clear();
+        for (int i = 0; i < count; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == signal_fd) {
+                running = false;
+            } else if (find(listeners.begin(), listeners.end(), fd) != listeners.end()) {
+                int client;
+                while ((client = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    connections[client].fd = client;
+                    watch(client, EPOLLIN, EPOLL_CTL_ADD);
                 }
-                placeTransaction(args);
+            } else {
+                auto it = connections.find(fd);
+                if (it == connections.end()) continue;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) serveInput(it->second);
+                ready.push_back(fd);
             }
         }
-        else {
-            // Query commands
-            if (command == "l") {
-                string x, y;
-                iss >> x >> y;
-                listTransactions(x, y);
+        
+        // the journal is on disk before any client sees the results
+        if (journal.enabled()) journal.commit();
+        
+        for (int fd : ready) {
+            auto it = connections.find(fd);
+            if (it == connections.end()) continue;
+            Connection& connection = it->second;
+            if (!sendReplies(connection)) {
+                disconnect(fd);
+            } else if (connection.replies.empty() && connection.closing) {
+                disconnect(fd);
+            } else {
+                // wait for room in the socket; stop reading once the client is done
+                uint32_t wanted = 0;
+                if (!connection.closing) wanted |= EPOLLIN;
+                if (!connection.replies.empty()) wanted |= EPOLLOUT;
+                watch(fd, wanted, EPOLL_CTL_MOD);
             }
-            else if (command == "r") {
-                string x, y;
-                iss >> x >> y;
-                calculateRevenue(x, y);
+        }
+    }
+    
+    while (!connections.empty()) disconnect(connections.begin()->first);
+    for (int fd : listeners) ::close(fd);
+    if (!listen_path.empty()) unlink(listen_path.c_str());
+    ::close(epoll_fd);
+    ::close(signal_fd);
+    output.redirect(STDOUT_FILENO);
+}
+
+// ---SERVER---
+
+// ---INGEST---
+
+// Apply operation lines until "$$$" (true) or the end of input (false)
+bool readOperations(CommandReader& reader) {
+    string_view line;
+    Tokens args;
+    while (reader.nextLine(line)) {
+        if (line.empty()) continue;
+        if (line == "$$$") return true;
+        if (line[0] == '#') continue; // Skip comments
+        
+        tokenize(line, args);
+        if (live_queries.active()) {
+            QueryCommand query;
+            if (parseQuery(args, query)) {
+                live_queries.query(query);
+                continue;
             }
-            else if (command == "h") {
-                string user_id;
-                iss >> user_id;
-                customerHistory(user_id);
+        }
+        
+        // Operation commands
+        reportCommandError(runOperation(args));
+        if (live_queries.active()) live_queries.flushOutput();
+    }
+    return false;
+}
+
+// Single-producer single-consumer ring of reusable slots. The producer
+// fills the slot from claim() and publishes it; the consumer uses the slot
+// from front() in place and then releases it. A full ring makes the
+// producer wait (back-pressure), an empty one the consumer.
+template <typename T, size_t CAPACITY>
+class SpscRing {
+public:
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "ring capacity must be a power of two");
+
+    SpscRing() : slots(new T[CAPACITY]) {}
+
+    // the next free slot, or nullptr if stop was raised while waiting
+    T* claim(const atomic<bool>& stop) {
+        size_t write = write_index.load(memory_order_relaxed);
+        while (write - read_index.load(memory_order_acquire) == CAPACITY) {
+            if (stop.load(memory_order_relaxed)) return nullptr;
+            this_thread::yield();
+        }
+        return &slots[write & (CAPACITY - 1)];
+    }
+
+    void publish() { write_index.store(write_index.load(memory_order_relaxed) + 1, memory_order_release); }
+
+    T& front() {
+        size_t read = read_index.load(memory_order_relaxed);
+        while (write_index.load(memory_order_acquire) == read) this_thread::yield();
+        return slots[read & (CAPACITY - 1)];
+    }
+
+    void release() { read_index.store(read_index.load(memory_order_relaxed) + 1, memory_order_release); }
+
+private:
+    unique_ptr<T[]> slots;
+    alignas(64) atomic<size_t> write_index{0};
+    alignas(64) atomic<size_t> read_index{0};
+};
+
+// The query a QUERY record was converted from
+QueryCommand decodeQuery(const BinaryCommands& commands, const CommandRecord& record) {
+    QueryCommand query;
+    query.type = record.detail;
+    query.x = Timestamp(record.timestamp);
+    query.y = Timestamp(record.exec_timestamp);
+    if (query.type == 'h') query.user_id = string(commands.text(record.user));
+    return query;
+}
+
+// readOperations over a binary command file (--binary)
+bool readOperations(BinaryCommands& commands) {
+    CommandRecord record;
+    OperationCommand op;
+    while (commands.next(record)) {
+        if (record.type == CommandRecord::QUERIES_FOLLOW) return true;
+        if (record.type == CommandRecord::QUERY) {
+            // without --live-queries these lines were ignored as unknown operations
+            if (live_queries.active()) live_queries.query(decodeQuery(commands, record));
+            continue;
+        }
+        
+        commands.decodeOperation(record, op);
+        reportCommandError(executeOperation(op));
+        if (live_queries.active()) live_queries.flushOutput();
+    }
+    return false;
+}
+
+// readQueryBatch over a binary command file
+vector<QueryCommand> readQueryBatch(BinaryCommands& commands) {
+    vector<QueryCommand> batch;
+    CommandRecord record;
+    while (commands.next(record)) {
+        if (record.type == CommandRecord::QUERY) batch.push_back(decodeQuery(commands, record));
+    }
+    return batch;
+}
+
+// Pipelined ingest (--pipeline): a parser thread reads, tokenizes and
+// parses lines into ring slots, and the engine thread applies them in order.
+// Each slot keeps its own copy of the line for the parsed fields to view
+// into. The parser stops after "$$$", leaving the reader at the queries.
+// parseOperation's account lookups only read state that is fixed after
+// loading, but IpAddress::parse interns login IPs into ip_names on the
+// parser thread, so the engine thread must not touch ip_names (no
+// IpAddress::text(), parse or lookup) while the pipeline runs.
+struct ParsedLine {
+    enum Kind : uint8_t { OPERATION, QUERY, QUERIES_FOLLOW, END_OF_INPUT };
+
+    Kind kind = END_OF_INPUT;
+    string line;
+    OperationCommand op;
+    QueryCommand query;
+};
+
+class CommandPipeline {
+public:
+    void start(CommandReader& reader) {
+        stopping = false;
+        if (pipe2(wake_pipe, O_CLOEXEC) != 0) {
+            cerr << "Error: Could not start the parser thread\n";
+            exit(1);
+        }
+        // so stop() can end a read blocked on a pipe that is still open
+        reader.setWakeFd(wake_pipe[0]);
+        active_reader = &reader;
+        parser = thread([this, &reader]() { parse(reader); });
+    }
+
+    ParsedLine& next() { return ring.front(); }
+    void release() { ring.release(); }
+
+    // stop the parser if it is still running and wait for it
+    void stop() {
+        stopping = true;
+        if (!parser.joinable()) return;
+        writeAll(wake_pipe[1], "x", 1);
+        parser.join();
+        active_reader->setWakeFd(-1);
+        close(wake_pipe[0]);
+        close(wake_pipe[1]);
+    }
+
+private:
+    static const size_t RING_SLOTS = 4096;
+
+    void parse(CommandReader& reader) {
+        string_view line;
+        Tokens args;
+        ParsedLine::Kind last = ParsedLine::END_OF_INPUT;
+        while (reader.nextLine(line)) {
+            if (line.empty()) continue;
+            if (line == "$$$") {
+                last = ParsedLine::QUERIES_FOLLOW;
+                break;
             }
-            else if (command == "s") {
-                string timestamp;
-                iss >> timestamp;
-                summarizeDay(timestamp);
+            if (line[0] == '#') continue; // Skip comments
+            
+            ParsedLine* slot = ring.claim(stopping);
+            if (!slot) return;
+            slot->line.assign(line.data(), line.size());
+            tokenize(slot->line, args);
+            if (live_query_mode && parseQuery(args, slot->query)) {
+                slot->kind = ParsedLine::QUERY;
+            } else {
+                parseOperation(args, slot->op);
+                if (slot->op.type == OperationCommand::NONE) continue; // reuse the slot
+                slot->kind = ParsedLine::OPERATION;
             }
-            else if (command == "") {
+            ring.publish();
+        }
+        
+        ParsedLine* slot = ring.claim(stopping);
+        if (!slot) return;
+        slot->kind = last;
+        ring.publish();
+    }
+
+    SpscRing<ParsedLine, RING_SLOTS> ring;
+    thread parser;
+    int wake_pipe[2] = {-1, -1};
+    CommandReader* active_reader = nullptr;
+    atomic<bool> stopping{false};
+};
+CommandPipeline command_pipeline;
+
+// readOperations with parsing on the pipeline's thread
+bool readOperationsPipelined(CommandReader& reader) {
+    command_pipeline.start(reader);
+    while (true) {
+        ParsedLine& parsed = command_pipeline.next();
+        switch (parsed.kind) {
+            case ParsedLine::OPERATION:
+                reportCommandError(executeOperation(parsed.op));
+                if (live_queries.active()) live_queries.flushOutput();
                 break;
+            case ParsedLine::QUERY:
+                live_queries.query(parsed.query);
+                break;
+            default: {
+                bool reached_queries = parsed.kind == ParsedLine::QUERIES_FOLLOW;
+                command_pipeline.release();
+                command_pipeline.stop();
+                return reached_queries;
             }
         }
+        command_pipeline.release();
+    }
+}
+
+// "$$$": snapshot, drain everything still pending, then answer the queries
+// read from the rest of the input
+void answerQueries(const vector<QueryCommand>& queries) {
+    if (!snapshot_filename.empty()) saveSnapshot(snapshot_filename);
+    query_mode = true;
+    // Process any remaining transactions
+    while (!transaction_queue.empty()) {
+        processTransactions();
+    }
+    runQueryBatch(queries);
+}
+
+// ---INGEST---
+
+// ------MAIN------
+// benchmarks include this file with BANK_NO_MAIN to reuse the engine
+#ifndef BANK_NO_MAIN
+int main(int argc, char* argv[]) {
+
+    getOptions(argc, argv);
+    stats.enabled = !stats_filename.empty();
+    if (!events_filename.empty()) event_log.open(events_filename);
+    // *received registration file in getOptions
+    if (!restore_filename.empty()) {
+        restoreSnapshot(restore_filename);
+    } else {
+        loadRegistrationFile(registration_filename);
+    }
+    if (!journal_filename.empty()) {
+        replayJournal(journal.open(journal_filename, journal_sync, accounts.user_ids.size(), stateFingerprint()));
+    }
+    
+    if (!listen_path.empty() || tcp_port != 0) {
+        runServer();
+        if (!snapshot_filename.empty()) saveSnapshot(snapshot_filename);
+        if (stats.enabled) writeStatsReport(stats_filename);
+        return 0;
     }
     
+    if (live_query_mode) {
+        live_queries.start();
+        // errors that exit(1) still get the output before them written
+        atexit([]() { live_queries.finish(); });
+    }
+    if (pipeline_mode) {
+        // an exit(1) from the engine has to stop the parser before globals go away
+        atexit([]() { command_pipeline.stop(); });
+    }
+    
+    bool reached_queries = false;
+    vector<QueryCommand> queries;
+    if (binary_input) {
+        BinaryCommands commands(STDIN_FILENO);
+        reached_queries = readOperations(commands);
+        // Everything after "$$$" is a query
+        if (reached_queries) queries = readQueryBatch(commands);
+    } else {
+        CommandReader reader(STDIN_FILENO);
+        reached_queries = pipeline_mode ? readOperationsPipelined(reader) : readOperations(reader);
+        if (reached_queries) queries = readQueryBatch(reader);
+    }
+    live_queries.finish();
+    if (reached_queries) {
+        answerQueries(queries);
+    } else if (!snapshot_filename.empty()) {
+        // Input ended without a query section
+        saveSnapshot(snapshot_filename);
+    }
+    if (stats.enabled) writeStatsReport(stats_filename);
+    
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,160 @@
+// Converts a text command file into the binary command format that
+// "bank --binary" replays without text parsing (see CommandRecord in
+// bank.cpp). Lines are classified exactly as the engine would classify
+// them, and lines the engine skips are left out.
+//
+// Build: g++ -std=c++17 -O3 -pthread bench/command_convert.cpp -o command_convert
+// Usage: ./command_convert commands.txt commands.bin
+//        ./bank -f registrations.txt --binary < commands.bin
+
+#define BANK_NO_MAIN
+#include "../bank.cpp"
+
+#include <cstdio>
+
+// Strings by first appearance; string 0 is ""
+class StringTable {
+public:
+    StringTable() { add(""); }
+
+    uint32_t add(string_view text) {
+        auto it = indices.find(string(text));
+        if (it != indices.end()) return it->second;
+        uint32_t index = static_cast<uint32_t>(offsets.size() - 1);
+        indices.emplace(string(text), index);
+        bytes.append(text.data(), text.size());
+        if (bytes.size() > UINT32_MAX) {
+            cerr << "Error: Command file has more than 4 GiB of distinct strings.\n";
+            exit(1);
+        }
+        offsets.push_back(static_cast<uint32_t>(bytes.size()));
+        return index;
+    }
+
+    uint32_t size() const { return static_cast<uint32_t>(offsets.size() - 1); }
+
+    unordered_map<string, uint32_t> indices;
+    vector<uint32_t> offsets = {0};
+    string bytes;
+};
+
+// The record for an operation line, following parseOperation; false for
+// lines that are not operations
+bool convertOperation(const Tokens& args, StringTable& strings, CommandRecord& record) {
+    string_view command = args[0];
+    if (command == "login") {
+        record.type = CommandRecord::LOGIN;
+        record.user = strings.add(args[1]);
+        record.other = strings.add(args[2]);
+        record.ip = strings.add(args[3]);
+    } else if (command == "out" || command == "balance") {
+        record.type = command == "out" ? CommandRecord::LOGOUT : CommandRecord::BALANCE;
+        record.user = strings.add(args[1]);
+        record.ip = strings.add(args[2]);
+    } else if (command == "place") {
+        if (args.count != 8) {
+            record.type = CommandRecord::BAD_PLACE;
+            return true;
+        }
+        // place <timestamp> <ip> <sender> <recipient> <amount> <exec_date> <o/s>
+        record.type = CommandRecord::PLACE;
+        record.timestamp = Timestamp::parse(args[1]).value;
+        record.ip = strings.add(args[2]);
+        record.user = strings.add(args[3]);
+        record.other = strings.add(args[4]);
+        record.amount = parseUnsigned(args[5]);
+        record.exec_timestamp = Timestamp::parse(args[6]).value;
+        record.detail = args[7][0];
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// The record for a query line, following parseQuery; false if not a query
+bool convertQuery(const Tokens& args, StringTable& strings, CommandRecord& record) {
+    QueryCommand query;
+    if (!parseQuery(args, query)) return false;
+    record.type = CommandRecord::QUERY;
+    record.detail = query.type;
+    record.timestamp = query.x.value;
+    record.exec_timestamp = query.y.value;
+    if (query.type == 'h') record.user = strings.add(query.user_id);
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        cerr << "Usage: " << argv[0] << " commands.txt commands.bin\n";
+        return 1;
+    }
+    int in = ::open(argv[1], O_RDONLY);
+    if (in < 0) {
+        cerr << "Error: Could not open " << argv[1] << "\n";
+        return 1;
+    }
+
+    StringTable strings;
+    vector<CommandRecord> records;
+    CommandReader reader(in);
+    string_view line;
+    Tokens args;
+
+    // Operations, with query lines kept for --live-queries, up to "$$$"
+    bool reached_queries = false;
+    while (reader.nextLine(line)) {
+        if (line.empty()) continue;
+        if (line == "$$$") {
+            reached_queries = true;
+            break;
+        }
+        if (line[0] == '#') continue; // Skip comments
+
+        tokenize(line, args);
+        CommandRecord record = {};
+        if (convertQuery(args, strings, record) || convertOperation(args, strings, record)) records.push_back(record);
+    }
+
+    // Queries, up to a blank command line as in readQueryBatch
+    if (reached_queries) {
+        CommandRecord follow = {};
+        follow.type = CommandRecord::QUERIES_FOLLOW;
+        records.push_back(follow);
+        while (reader.nextLine(line)) {
+            if (line.empty() || line == "$$$" || line[0] == '#') continue;
+
+            tokenize(line, args);
+            if (args[0].empty()) break;
+
+            CommandRecord record = {};
+            if (convertQuery(args, strings, record)) records.push_back(record);
+        }
+    }
+    ::close(in);
+
+    CommandFileHeader header = {};
+    memcpy(header.magic, COMMAND_FILE_MAGIC, sizeof(COMMAND_FILE_MAGIC));
+    header.version = COMMAND_FILE_VERSION;
+    header.string_count = strings.size();
+    header.string_bytes = strings.bytes.size();
+    header.record_count = records.size();
+
+    int out_fd = ::open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        cerr << "Error: Could not open " << argv[2] << "\n";
+        return 1;
+    }
+    bool written = writeAll(out_fd, reinterpret_cast<const char*>(&header), sizeof(header)) &&
+                   writeAll(out_fd, reinterpret_cast<const char*>(strings.offsets.data()),
+                            strings.offsets.size() * sizeof(uint32_t)) &&
+                   writeAll(out_fd, strings.bytes.data(), strings.bytes.size()) &&
+                   writeAll(out_fd, reinterpret_cast<const char*>(records.data()),
+                            records.size() * sizeof(CommandRecord));
+    if (!written || ::close(out_fd) != 0) {
+        cerr << "Error: Could not write " << argv[2] << "\n";
+        return 1;
+    }
+
+    printf("%zu records, %u strings (%zu bytes)\n", records.size(), strings.size(), strings.bytes.size());
+    return 0;
+}
@@ -0,0 +1,169 @@
+// Throughput and latency of the engine's hot paths on a workload from
+// workload_gen: registration loading, placeTransaction, processTransactions
+// drains, the transaction scheduler, and each query type.
+//
+// Build: g++ -std=c++17 -O3 -pthread bench/engine_bench.cpp -o engine_bench
+// Usage: ./engine_bench registrations.txt commands.txt
+//
+// processTransactions is timed on its own by draining up to each place
+// command's timestamp just before the command runs, so the drain inside
+// placeTransaction finds nothing due. balance commands only print and are
+// skipped.
+
+#define BANK_NO_MAIN
+#include "../bank.cpp"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+using bench_clock = chrono::steady_clock;
+
+uint64_t nanosSince(bench_clock::time_point start) {
+    return static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(bench_clock::now() - start).count());
+}
+
+// Per-call latencies of one operation
+struct LatencyStats {
+    string name;
+    size_t items_per_sample = 1;
+    vector<uint64_t> samples;
+
+    LatencyStats(string name, size_t items_per_sample = 1) : name(name), items_per_sample(items_per_sample) {}
+
+    void add(uint64_t nanos) { samples.push_back(nanos); }
+
+    uint64_t percentile(double fraction) {
+        size_t rank = static_cast<size_t>(fraction * static_cast<double>(samples.size() - 1));
+        nth_element(samples.begin(), samples.begin() + static_cast<long>(rank), samples.end());
+        return samples[rank];
+    }
+
+    void report() {
+        if (samples.empty()) {
+            printf("%-28s %10s\n", name.c_str(), "-");
+            return;
+        }
+        uint64_t total = 0;
+        for (uint64_t sample : samples) total += sample;
+        double items = static_cast<double>(samples.size() * items_per_sample);
+        printf("%-28s %10zu %12.3f %14.0f %10.1f %10llu %10llu %12llu\n", name.c_str(), samples.size(),
+               static_cast<double>(total) / 1e6, items / (static_cast<double>(total) / 1e9),
+               static_cast<double>(total) / items, static_cast<unsigned long long>(percentile(0.5)),
+               static_cast<unsigned long long>(percentile(0.99)),
+               static_cast<unsigned long long>(*max_element(samples.begin(), samples.end())));
+    }
+};
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        cerr << "Usage: " << argv[0] << " registrations.txt commands.txt\n";
+        return 1;
+    }
+
+    LatencyStats load("loadRegistrationFile");
+    auto start = bench_clock::now();
+    loadRegistrationFile(argv[1]);
+    load.add(nanosSince(start));
+    load.items_per_sample = max<size_t>(1, accounts.user_ids.size());
+
+    int fd = open(argv[2], O_RDONLY);
+    if (fd < 0) {
+        cerr << "Error: Could not open command file " << argv[2] << "\n";
+        return 1;
+    }
+    CommandReader reader(fd);
+
+    LatencyStats place("placeTransaction");
+    LatencyStats drain("processTransactions");
+    LatencyStats final_drain("processTransactions ($$$)");
+    LatencyStats session("login/out");
+    size_t drained = 0;
+    string_view line;
+    Tokens args;
+    while (reader.nextLine(line)) {
+        if (line.empty() || line[0] == '#') continue;
+        if (line == "$$$") {
+            query_mode = true;
+            size_t before = transaction_history.size();
+            start = bench_clock::now();
+            processTransactions();
+            final_drain.add(nanosSince(start));
+            final_drain.items_per_sample = max<size_t>(1, transaction_history.size() - before);
+            break;
+        }
+        tokenize(line, args);
+        if (args[0] == "place" && args.count == 8) {
+            size_t before = transaction_history.size();
+            current_timestamp = Timestamp::parse(args[1]);
+            start = bench_clock::now();
+            processTransactions();
+            drain.add(nanosSince(start));
+            drained += transaction_history.size() - before;
+
+            start = bench_clock::now();
+            reportCommandError(runOperation(args));
+            place.add(nanosSince(start));
+        } else if (args[0] == "login") {
+            start = bench_clock::now();
+            reportCommandError(runOperation(args));
+            session.add(nanosSince(start));
+        } else if (args[0] == "out") {
+            start = bench_clock::now();
+            reportCommandError(runOperation(args));
+            session.add(nanosSince(start));
+        }
+    }
+
+    // TransactionScheduler on its own: batches drawn from the executed
+    // history are scheduled in id order into a fresh wheel and drained
+    const size_t SCHEDULE_BATCH = 1000;
+    LatencyStats scheduler("schedule + popDue", SCHEDULE_BATCH);
+    if (!transaction_history.empty()) {
+        mt19937 rng(281);
+        uniform_int_distribution<size_t> pick(0, transaction_history.size() - 1);
+        vector<Transaction> batch_items(SCHEDULE_BATCH);
+        size_t result = 0;
+        for (int batch = 0; batch < 1000; ++batch) {
+            for (Transaction& t : batch_items) t = transaction_history[pick(rng)];
+            sort(batch_items.begin(), batch_items.end(),
+                 [](const Transaction& a, const Transaction& b) { return a.id < b.id; });
+            TransactionScheduler wheel;
+            Transaction t;
+            start = bench_clock::now();
+            for (const Transaction& item : batch_items) wheel.schedule(item);
+            while (wheel.popDue(Timestamp(UINT64_MAX), t)) result += t.id;
+            scheduler.add(nanosSince(start));
+        }
+        if (result == SIZE_MAX) printf("unreachable\n");
+    }
+
+    LatencyStats queries[4] = {{"query l"}, {"query r"}, {"query h"}, {"query s"}};
+    size_t output_bytes = 0;
+    for (const QueryCommand& query : readQueryBatch(reader)) {
+        OutputBuffer scratch;
+        start = bench_clock::now();
+        runQuery(scratch, query);
+        uint64_t nanos = nanosSince(start);
+        output_bytes += scratch.contents().size();
+        switch (query.type) {
+            case 'l': queries[0].add(nanos); break;
+            case 'r': queries[1].add(nanos); break;
+            case 'h': queries[2].add(nanos); break;
+            default: queries[3].add(nanos); break;
+        }
+    }
+
+    printf("accounts %zu, executed %zu (%zu before $$$), query output %zu bytes\n\n",
+           accounts.user_ids.size(), transaction_history.size(), drained, output_bytes);
+    printf("%-28s %10s %12s %14s %10s %10s %10s %12s\n", "operation", "calls", "total ms", "items/s",
+           "ns/item", "p50 ns", "p99 ns", "max ns");
+    load.report();
+    session.report();
+    place.report();
+    drain.report();
+    final_drain.report();
+    scheduler.report();
+    for (LatencyStats& stats : queries) stats.report();
+    return 0;
+}
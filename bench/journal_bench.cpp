@@ -0,0 +1,66 @@
+// Journal throughput versus fsync interval, next to the cost of parsing the
+// place command being journaled.
+//
+// Build: g++ -std=c++17 -O3 -pthread bench/journal_bench.cpp -o journal_bench
+// Usage: ./journal_bench [records] [journal path]
+
+#define BANK_NO_MAIN
+#include "../bank.cpp"
+
+#include <chrono>
+#include <cstdio>
+
+using bench_clock = chrono::steady_clock;
+
+double secondsSince(bench_clock::time_point start) {
+    return chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[]) {
+    size_t records = argc > 1 ? stoul(argv[1]) : 200000;
+    string path = argc > 2 ? argv[2] : "journal_bench.tmp";
+
+    // Parse cost of the command each placement record stands for
+    const string_view place_line = "place 08:03:01:09:00:00 231.43.171.61 paoletti1 mmmmm 2000 08:03:02:09:00:00 s";
+    Tokens args;
+    uint64_t checksum = 0;
+    auto start = bench_clock::now();
+    for (size_t i = 0; i < records; ++i) {
+        tokenize(place_line, args);
+        checksum += Timestamp::parse(args[1]).value + parseUnsigned(args[5]) + Timestamp::parse(args[6]).value;
+    }
+    double parse_ns = secondsSince(start) * 1e9 / static_cast<double>(records);
+    printf("place parse: %.1f ns/command (checksum %llu)\n\n", parse_ns,
+           static_cast<unsigned long long>(checksum % 10));
+
+    printf("%-14s %10s %14s %12s %10s\n", "fsync every", "records", "records/s", "ns/record", "vs parse");
+    for (size_t interval : {0, 1, 8, 64, 512, 4096}) {
+        // keep the slow settings to a bounded number of fsyncs
+        size_t count = interval ? min(records, interval * 2000) : records;
+        unlink(path.c_str());
+        Journal bench_journal;
+        bench_journal.open(path, interval, 0, 0);
+
+        Transaction t;
+        t.place_timestamp = Timestamp(80301090000);
+        t.exec_timestamp = Timestamp(80302090000);
+        t.sender = 1;
+        t.recipient = 2;
+        t.amount = 2000;
+        t.fee_type = 's';
+        start = bench_clock::now();
+        for (size_t i = 0; i < count; ++i) {
+            t.id = static_cast<int>(i);
+            if (i % 2 == 0) bench_journal.recordPlacement(t);
+            else bench_journal.recordExecution(t.id, 20);
+        }
+        bench_journal.close();
+        double seconds = secondsSince(start);
+
+        double ns = seconds * 1e9 / static_cast<double>(count);
+        printf("%-14s %10zu %14.0f %12.1f %9.2fx\n", interval ? to_string(interval).c_str() : "never",
+               count, static_cast<double>(count) / seconds, ns, ns / parse_ns);
+    }
+    unlink(path.c_str());
+    return 0;
+}
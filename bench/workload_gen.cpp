@@ -0,0 +1,278 @@
+// Synthetic workload generator: writes a registration file and a command
+// stream (operations, "$$$", then queries) at a configurable scale.
+//
+// Build: g++ -std=c++17 -O3 bench/workload_gen.cpp -o workload_gen
+// Usage: ./workload_gen --registrations reg.txt --commands cmds.txt [options]
+
+#include <iostream>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+#include <getopt.h>
+
+using namespace std;
+
+// ---OPTIONS---
+string registrations_filename;
+string commands_filename;
+uint64_t seed = 281;
+size_t account_count = 10000;
+size_t operation_count = 100000;
+size_t query_count = 1000;
+// relative weights of login / place / out / balance operations
+double mix[4] = {30, 50, 15, 5};
+// relative weights of l / r / h / s queries
+double query_mix[4] = {25, 25, 25, 25};
+// latest execution date, in seconds after placement; the engine also caps
+// it at 3 days on the packed yymmddhhmmss value, i.e. within the same month
+uint32_t max_exec_delay = 3 * 24 * 60 * 60;
+
+void printHelp(const char* command) {
+    cout << "Usage: " << command << " --registrations file --commands file [options]\n\n";
+    cout << "Options:\n";
+    cout << "  -h, --help                 Show this help message\n";
+    cout << "  -r, --registrations file   Registration file to write (required)\n";
+    cout << "  -c, --commands file        Command file to write (required)\n";
+    cout << "  -a, --accounts N           Number of accounts (default 10000)\n";
+    cout << "  -n, --operations N         Number of operation commands (default 100000)\n";
+    cout << "  -q, --queries N            Number of queries after $$$ (default 1000)\n";
+    cout << "  -m, --mix L:P:O:B          Weights of login/place/out/balance (default 30:50:15:5)\n";
+    cout << "  -Q, --query-mix L:R:H:S    Weights of l/r/h/s queries (default 25:25:25:25)\n";
+    cout << "  -d, --max-exec-delay S     Latest execution, seconds after placement (default 259200);\n";
+    cout << "                             never past 3 days later or the end of the month\n";
+    cout << "  -s, --seed N               Random seed (default 281)\n";
+}
+
+// parse "a:b:c:d" into four weights
+void parseMix(const char* text, double* weights) {
+    string rest = text;
+    for (int i = 0; i < 4; ++i) {
+        size_t stop = rest.find(':');
+        weights[i] = stod(rest.substr(0, stop));
+        rest = (stop == string::npos) ? "0" : rest.substr(stop + 1);
+    }
+}
+
+void getOptions(int argc, char** argv) {
+    struct option long_options[] = {
+        {"help", no_argument, nullptr, 'h'},
+        {"registrations", required_argument, nullptr, 'r'},
+        {"commands", required_argument, nullptr, 'c'},
+        {"accounts", required_argument, nullptr, 'a'},
+        {"operations", required_argument, nullptr, 'n'},
+        {"queries", required_argument, nullptr, 'q'},
+        {"mix", required_argument, nullptr, 'm'},
+        {"query-mix", required_argument, nullptr, 'Q'},
+        {"max-exec-delay", required_argument, nullptr, 'd'},
+        {"seed", required_argument, nullptr, 's'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    int option_index = 0;
+
+    while ((opt = getopt_long(argc, argv, "hr:c:a:n:q:m:Q:d:s:", long_options, &option_index)) != -1) {
+        switch (opt) {
+            case 'h':
+                printHelp(argv[0]);
+                exit(0);
+            case 'r':
+                registrations_filename = optarg;
+                break;
+            case 'c':
+                commands_filename = optarg;
+                break;
+            case 'a':
+                account_count = stoul(optarg);
+                break;
+            case 'n':
+                operation_count = stoul(optarg);
+                break;
+            case 'q':
+                query_count = stoul(optarg);
+                break;
+            case 'm':
+                parseMix(optarg, mix);
+                break;
+            case 'Q':
+                parseMix(optarg, query_mix);
+                break;
+            case 'd':
+                max_exec_delay = static_cast<uint32_t>(stoul(optarg));
+                break;
+            case 's':
+                seed = stoull(optarg);
+                break;
+            default:
+                cerr << "Invalid option. Use --help to see usage.\n";
+                exit(1);
+        }
+    }
+
+    if (registrations_filename.empty() || commands_filename.empty() || account_count < 2) {
+        cerr << "Error: --registrations and --commands are required, with at least 2 accounts.\n";
+        exit(1);
+    }
+}
+
+// ---OPTIONS---
+
+// Calendar time kept in valid ranges (days stop at 28 to keep months even)
+// and printed in the "yy:mm:dd:hh:mm:ss" input form
+struct Clock {
+    int fields[6] = {8, 1, 1, 0, 0, 0}; // yy mm dd hh mm ss
+
+    void addSeconds(uint64_t seconds) {
+        static const int limits[6] = {100, 13, 29, 24, 60, 60};
+        static const int bases[6] = {0, 1, 1, 0, 0, 0};
+        uint64_t carry = seconds;
+        for (int i = 5; i >= 0 && carry > 0; --i) {
+            uint64_t span = static_cast<uint64_t>(limits[i] - bases[i]);
+            uint64_t value = static_cast<uint64_t>(fields[i] - bases[i]) + carry;
+            fields[i] = static_cast<int>(value % span) + bases[i];
+            carry = value / span;
+        }
+    }
+
+    // yymmddhhmmss as one number, the form the engine compares timestamps in
+    uint64_t packed() const {
+        uint64_t value = 0;
+        for (int field : fields) value = value * 100 + static_cast<uint64_t>(field);
+        return value;
+    }
+
+    // The latest execution date the engine accepts for a placement at this
+    // time: the packed difference may be at most 3000000, so 3 days later
+    // at the same time of day, or the end of the month when that is sooner
+    Clock latestExec() const {
+        Clock latest = *this;
+        if (fields[2] + 3 <= 28) {
+            latest.fields[2] += 3;
+        } else {
+            latest.fields[2] = 28;
+            latest.fields[3] = 23;
+            latest.fields[4] = 59;
+            latest.fields[5] = 59;
+        }
+        return latest;
+    }
+
+    string str() const {
+        char text[18];
+        snprintf(text, sizeof(text), "%02d:%02d:%02d:%02d:%02d:%02d",
+                 fields[0], fields[1], fields[2], fields[3], fields[4], fields[5]);
+        return text;
+    }
+};
+
+struct Account {
+    string user_id;
+    string pin;
+    string ip;
+    bool logged_in = false;
+};
+
+int main(int argc, char* argv[]) {
+    getOptions(argc, argv);
+    mt19937_64 rng(seed);
+    auto uniform = [&rng](size_t n) { return uniform_int_distribution<size_t>(0, n - 1)(rng); };
+
+    // Registrations: spread over the 8 years before the first command so
+    // some senders get the long-standing customer discount
+    vector<Account> accounts(account_count);
+    ofstream registrations(registrations_filename);
+    for (size_t i = 0; i < account_count; ++i) {
+        Account& account = accounts[i];
+        account.user_id = "user" + to_string(i);
+        account.pin = to_string(100000 + uniform(900000));
+        account.ip = to_string(1 + uniform(254)) + "." + to_string(uniform(256)) + "." +
+                     to_string(uniform(256)) + "." + to_string(1 + uniform(254));
+        Clock registered;
+        registered.fields[0] = static_cast<int>(uniform(7));
+        registered.addSeconds(uniform(365 * 24 * 60 * 60));
+        registrations << registered.str() << '|' << account.user_id << '|' << account.pin << '|'
+                      << 1000 + uniform(1000000) << '\n';
+    }
+
+    ofstream commands(commands_filename);
+    commands << "# generated: " << account_count << " accounts, " << operation_count
+             << " operations, " << query_count << " queries, seed " << seed << "\n";
+    discrete_distribution<int> pick_operation(begin(mix), end(mix));
+    vector<size_t> logged_in;
+    Clock now;
+    Clock first = now;
+    uint64_t elapsed = 0;
+    for (size_t i = 0; i < operation_count; ++i) {
+        int operation = pick_operation(rng);
+        if (operation != 0 && logged_in.empty()) operation = 0;
+        switch (operation) {
+            case 0: { // login (a few with a wrong pin)
+                Account& account = accounts[uniform(account_count)];
+                bool good = uniform(50) != 0;
+                commands << "login " << account.user_id << ' ' << (good ? account.pin : "000000") << ' '
+                         << account.ip << '\n';
+                if (good && !account.logged_in) {
+                    account.logged_in = true;
+                    logged_in.push_back(static_cast<size_t>(&account - accounts.data()));
+                }
+                break;
+            }
+            case 1: { // place
+                uint64_t step = uniform(60);
+                now.addSeconds(step);
+                elapsed += step;
+                Account& sender = accounts[logged_in[uniform(logged_in.size())]];
+                Account& recipient = accounts[uniform(account_count)];
+                Clock exec = now;
+                exec.addSeconds(uniform(max_exec_delay + 1));
+                Clock latest = now.latestExec();
+                if (exec.packed() > latest.packed()) exec = latest;
+                commands << "place " << now.str() << ' ' << sender.ip << ' ' << sender.user_id << ' '
+                         << recipient.user_id << ' ' << 1 + uniform(5000) << ' ' << exec.str() << ' '
+                         << (uniform(2) ? 'o' : 's') << '\n';
+                break;
+            }
+            case 2: { // out
+                size_t slot = uniform(logged_in.size());
+                Account& account = accounts[logged_in[slot]];
+                commands << "out " << account.user_id << ' ' << account.ip << '\n';
+                account.logged_in = false;
+                logged_in[slot] = logged_in.back();
+                logged_in.pop_back();
+                break;
+            }
+            default: { // balance
+                Account& account = accounts[logged_in[uniform(logged_in.size())]];
+                commands << "balance " << account.user_id << ' ' << account.ip << '\n';
+                break;
+            }
+        }
+    }
+
+    // Queries cover the operation window plus the 3-day execution tail
+    commands << "$$$\n";
+    discrete_distribution<int> pick_query(begin(query_mix), end(query_mix));
+    uint64_t window = elapsed + max_exec_delay + 1;
+    for (size_t i = 0; i < query_count; ++i) {
+        Clock x = first;
+        x.addSeconds(uniform(window));
+        Clock y = x;
+        y.addSeconds(1 + uniform(window / 4 + 1));
+        switch (pick_query(rng)) {
+            case 0:
+                commands << "l " << x.str() << ' ' << y.str() << '\n';
+                break;
+            case 1:
+                commands << "r " << x.str() << ' ' << y.str() << '\n';
+                break;
+            case 2:
+                commands << "h " << accounts[uniform(account_count)].user_id << '\n';
+                break;
+            default:
+                commands << "s " << x.str() << '\n';
+                break;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,72 @@
+#!/bin/sh
+# The balance policy of each diagnostics mode (CHECKS_BALANCE_SESSION in
+# bank.cpp): --verbose and --events refuse a balance check for a logged-out
+# account or from an IP it is not logged in from; quiet mode reports the
+# balance of any existing account.
+#
+# Usage: tests/balance_policy.sh ./bank
+set -u
+bank=${1:?usage: $0 path/to/bank}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+cat > "$dir/reg.txt" <<'REG'
+08:03:01:09:00:00|alice|1111|500
+08:03:01:09:00:00|bob|2222|700
+REG
+
+cat > "$dir/commands.txt" <<'CMD'
+login alice 1111 1.1.1.1
+balance alice 1.1.1.1
+balance alice 2.2.2.2
+balance bob 3.3.3.3
+out alice 1.1.1.1
+balance alice 1.1.1.1
+balance carol 1.1.1.1
+CMD
+
+# check <name> <expected file> <actual file>
+check() {
+    if cmp -s "$2" "$3"; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1"
+        diff "$2" "$3"
+        failed=1
+    fi
+}
+
+cat > "$dir/verbose.expected" <<'OUT'
+User alice logged in.
+As of 80301090000, alice has a balance of $500.
+Fraudulent balance check detected, aborting request.
+User bob is not logged in.
+User alice logged out.
+User alice is not logged in.
+User carol does not exist.
+OUT
+"$bank" -f "$dir/reg.txt" -v < "$dir/commands.txt" > "$dir/verbose.out"
+check "verbose refuses logged-out and foreign-IP balance checks" "$dir/verbose.expected" "$dir/verbose.out"
+
+cat > "$dir/quiet.expected" <<'OUT'
+As of 80301090000, alice has a balance of $500.
+As of 80301090000, alice has a balance of $500.
+As of 80301090000, bob has a balance of $700.
+As of 80301090000, alice has a balance of $500.
+OUT
+"$bank" -f "$dir/reg.txt" < "$dir/commands.txt" > "$dir/quiet.out"
+check "quiet reports any existing account's balance" "$dir/quiet.expected" "$dir/quiet.out"
+
+cat > "$dir/events.expected" <<'OUT'
+As of 80301090000, alice has a balance of $500.
+OUT
+# the type byte of each 32-byte DiagnosticEvent: LOGGED_IN, BALANCE_FRAUD,
+# BALANCE_NOT_LOGGED_IN, LOGGED_OUT, BALANCE_NOT_LOGGED_IN, UNKNOWN_USER
+printf '1\n6\n5\n3\n5\n4\n' > "$dir/types.expected"
+"$bank" -f "$dir/reg.txt" --events "$dir/events.bin" < "$dir/commands.txt" > "$dir/events.out"
+check "--events refuses the same balance checks" "$dir/events.expected" "$dir/events.out"
+od -An -v -tu1 -w32 "$dir/events.bin" | awk '{ print $25 }' > "$dir/types.out"
+check "--events records the refusals" "$dir/types.expected" "$dir/types.out"
+
+exit $failed
@@ -0,0 +1,58 @@
+#!/bin/sh
+# Resuming from a snapshot plus journal (-r/-j) must reproduce an
+# uninterrupted run. The snapshot is taken with transactions still pending
+# at different exec times, a second session journals more placements on top
+# of it, and a third replays that journal before draining everything.
+#
+# Usage: tests/journal_restore.sh ./bank
+set -u
+bank=${1:?usage: $0 path/to/bank}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+cat > "$dir/reg.txt" <<'REG'
+08:03:01:09:00:00|alice|1111|500000
+08:03:01:09:00:00|bob|2222|700000
+REG
+
+cat > "$dir/part1.txt" <<'CMD'
+login alice 1111 1.1.1.1
+place 08:03:01:09:30:00 1.1.1.1 alice bob 1000 08:03:01:10:00:00 s
+place 08:03:01:09:31:00 1.1.1.1 alice bob 2000 08:03:02:10:00:00 o
+CMD
+
+cat > "$dir/part2.txt" <<'CMD'
+login bob 2222 2.2.2.2
+place 08:03:01:09:40:00 2.2.2.2 bob alice 3000 08:03:01:12:00:00 s
+place 08:03:01:09:41:00 2.2.2.2 bob alice 4000 08:03:03:09:00:00 o
+CMD
+
+cat > "$dir/part3.txt" <<'CMD'
+place 08:03:01:11:00:00 1.1.1.1 alice bob 5000 08:03:02:10:00:00 s
+balance alice 1.1.1.1
+$$$
+CMD
+
+# check <name> <expected file> <actual file>
+check() {
+    if cmp -s "$2" "$3"; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1"
+        diff "$2" "$3"
+        failed=1
+    fi
+}
+
+for mode in "" -v; do
+    cat "$dir/part1.txt" "$dir/part2.txt" "$dir/part3.txt" |
+        "$bank" -f "$dir/reg.txt" $mode > "$dir/expected.out"
+    rm -f "$dir/snapshot.bin" "$dir/journal.bin"
+    "$bank" -f "$dir/reg.txt" $mode -s "$dir/snapshot.bin" -j "$dir/journal.bin" < "$dir/part1.txt" > "$dir/resumed.out"
+    "$bank" -r "$dir/snapshot.bin" $mode -j "$dir/journal.bin" < "$dir/part2.txt" >> "$dir/resumed.out"
+    "$bank" -r "$dir/snapshot.bin" $mode -j "$dir/journal.bin" < "$dir/part3.txt" >> "$dir/resumed.out"
+    check "snapshot + journal matches an uninterrupted run${mode:+ ($mode)}" "$dir/expected.out" "$dir/resumed.out"
+done
+
+exit $failed